@@ -31,6 +31,8 @@
 #define DBUS_VERSION "1.2"
 
 extern void *ealloc(size_t);
+extern guint add_source(GSource *, GSourceFunc);
+extern void remove_source(guint);
 
 enum CloseReason {
     CLOSE_REASON_MIN        = 1,
@@ -45,20 +47,43 @@ extern NLNoteCallbacks callbacks;
 extern NLServerInfo *server_info;
 extern char **server_capabilities;
 
+/* The context D-Bus messages, expiry and (in single-threaded builds)
+ * callbacks are handled on.  NULL means the global default. */
+extern GMainContext *main_context;
+
 struct hints {
-    GVariantDict *dict;
+    GHashTable *table;  /* GQuark key -> GVariant value, for well-known keys */
+    GHashTable *other;  /* owned key -> GVariant value, or NULL if none */
+    size_t size;        /* approximate bytes, for the memory budget */
 };
 
+#if NL_ACTIONS
+/* Built once when the note is decoded and never modified afterward, so it
+ * can be read from any thread without locking. */
+struct action_index {
+    GHashTable *names;  /* key -> name; both point into NLActions.actions */
+};
+#endif
+
 
 // queue.c
 
+#if !NL_SINGLE_THREAD
 /* Entry point for callback thread. */
 extern void queue_listen(void);
+#endif
 
 /* Called by main thread. */
 extern void queue_notify (NLNote *, char *);
+extern void queue_notify_batch(NLNote **, char **, size_t);
 extern void queue_close  (uint32_t id, enum CloseReason);
+extern void queue_close_ids(const uint32_t *ids, size_t, enum CloseReason);
+extern void queue_close_app(const char *appname, enum CloseReason);
+extern void queue_close_all(enum CloseReason);
+extern void queue_handover(void);
 extern int  queue_call   (uint32_t id, int (*callback)(const NLNote *, void *), void *);
+extern int  queue_refresh(uint32_t id, const char *sender);
+extern size_t queue_stats(int64_t *oldest);
 #if NL_TAGS
 extern int  tag_to_id(char *tag);
 #endif
@@ -67,12 +92,19 @@ extern int  tag_to_id(char *tag);
 // idrange.c
 
 extern void claim_id(uint32_t);
+extern void claim_range(uint32_t, uint32_t);
 extern uint32_t get_unclaimed_id(void);
+extern void idrange_snapshot(GVariantBuilder *);
 
 // note.c
 
+extern const char *intern_ref(const char *);
+extern const char *intern_find(const char *);
+extern void intern_unref(const char *);
+extern void note_share(const NLNote *);
+extern const char *note_dest(const NLNote *);
 extern NLNote *new_note(uint32_t,     /* id */
-                        char *,       /* app name */
+                        const char *, /* app name (from intern_ref) */
                         char *,       /* summary */
                         char *,       /* body */
 #if NL_ACTIONS
@@ -80,21 +112,136 @@ extern NLNote *new_note(uint32_t,     /* id */
 #endif
 #if NL_URGENCY
                         enum NLUrgency, /* urgency */
+#endif
+#if NL_IMAGES
+                        NLImage *,      /* image */
 #endif
                         NLHints *,      /* hints */
                         int32_t       /* timeout */
                        );
 
 #if NL_ACTIONS
+extern NLActions *new_actions(char **, size_t);
 extern void free_actions(NLActions *);
 #endif
+extern NLHints *new_hints(GVariant *);
+extern GVariant *hints_lookup(const NLHints *, const char *, const GVariantType *);
+extern void hints_remove(NLHints *, const char *);
+extern void free_hints(NLHints *);
 extern void free_note(NLNote *);
 extern int32_t note_timeout(const NLNote *);
+extern size_t variant_size(GVariant *);
+extern size_t note_size(const NLNote *);
+extern GVariant *note_to_variant(const NLNote *, int32_t);
+
+// limits.c
+
+extern char *limit_summary(GVariant *);
+extern char *limit_body(GVariant *);
+extern size_t limit_hints(size_t);
+#if NL_ACTIONS
+extern char **limit_actions(GVariant *, size_t *);
+#endif
+#if NL_IMAGES
+extern int limit_image(GVariant *);
+#endif
+
+// dedup.c
+
+extern int dedup_enabled(void);
+extern uint64_t dedup_fingerprint(GVariant *);
+extern uint32_t dedup_lookup(uint64_t, GVariant *, const char *);
+extern void dedup_record(uint64_t, GVariant *, uint32_t);
+extern void dedup_forget(uint32_t);
+
+// history.c
+
+extern int history_enabled(void);
+extern int history_record(const NLNote *, int64_t opened, enum CloseReason);
+extern void history_set_evict_hook(void (*)(uint32_t));
+
+// handover.c
+
+extern int handover_enabled(void);
+extern int handover_pending(void);
+extern int handover_connect(void);
+extern void handover_listen(void);
+extern GVariant *handover_state(GVariant *);
+extern int handover_state_valid(GVariant *);
+extern void handover_send(GVariant *);
+
+// capture.c
+
+#define CAPTURE_MAGIC   "NLTRACE"   /* written with its NUL: 8 bytes */
+#define CAPTURE_VERSION 1
+
+enum capture_kind {
+    CAPTURE_NOTIFY          = 1,    /* (susssasa{sv}i) */
+    CAPTURE_CLOSE           = 2,    /* (u) */
+    CAPTURE_INVOKE_ACTION   = 3,    /* (us) */
+    CAPTURE_CLOSE_MANY      = 4     /* (au); the ID is 0 */
+};
+
+extern void capture_call(enum capture_kind, uint32_t, GVariant *);
+extern void capture_flush(void);
+
+// shm.c
+
+extern void shm_start(void);
+extern void shm_stop(void);
+extern int shm_enabled(void);
+extern void shm_add(const NLNote *, int64_t opened);
+extern void shm_remove(uint32_t);
+
+// watchdog.c
+
+#if !NL_SINGLE_THREAD
+extern void watchdog_start(void);
+extern void watchdog_enter(const char *, uint32_t);
+extern void watchdog_leave(void);
+#endif
+
+// rules.c
+
+typedef struct {
+    int32_t timeout;    /* -1 to leave alone */
+    int urgency;        /* -1 to leave alone */
+    const char *tag;    /* NULL to leave alone */
+} rule_result;
+
+extern int rules_enabled(void);
+extern int rules_match(GVariant *, rule_result *);
+
+// search.c
+
+#if NL_SEARCH
+extern void search_add(const NLNote *);
+extern void search_close(uint32_t, int kept);
+extern void search_forget(uint32_t);
+#endif
+
+// markup.c
+
+#if NL_MARKUP
+extern NLMarkup *markup_parse(const char *);
+#endif
+
+// image.c
+
+#if NL_IMAGES
+extern NLImage *image_from_hints(NLHints *);
+#endif
 
 // dbus.c
 
-extern void signal_notification_closed(uint32_t, enum CloseReason);
-extern void signal_action_invoked(uint32_t, const char *);
+extern void signal_notification_closed(uint32_t, const char *, enum CloseReason);
+extern void signal_notifications_closed(const uint32_t *, const char **, size_t,
+                                        enum CloseReason);
+extern void signal_action_invoked(uint32_t, const char *, const char *);
+extern void dbus_start(void);
 extern void *run_dbus_loop(void *);
+extern void dbus_restore(GVariant *);
+extern void dbus_stop(void);
+extern void decode_drain(void);
 
 #endif  // _NOTLIB_INTERNAL_H
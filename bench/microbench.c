@@ -0,0 +1,404 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Microbenchmarks for notlib's internal data structures, run in-process with
+ * no D-Bus involved.  queue.c and idrange.c are included wholesale so that
+ * their static functions and state can be exercised directly.
+ *
+ * Each result is printed as one line of JSON on stdout:
+ *
+ *   {"bench": "queue_find_id/10000", "ops": 100000, "ns_per_op": 1234.5}
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "../queue.c"
+#include "../idrange.c"
+
+/*
+ * Stand-ins for the D-Bus side of things.
+ */
+
+char **server_capabilities = NULL;
+NLServerInfo *server_info = NULL;
+
+void signal_notification_closed(uint32_t id, const char *dest,
+                                enum CloseReason reason) {}
+void signal_notifications_closed(const uint32_t *ids, const char **dests,
+                                 size_t n, enum CloseReason reason) {}
+#if NL_ACTIONS
+void signal_action_invoked(uint32_t id, const char *dest, const char *key) {}
+#endif
+void dbus_start(void) {}
+void *run_dbus_loop(void *_) { return NULL; }
+void dbus_restore(GVariant *state) {}
+void dbus_stop(void) {}
+void decode_drain(void) {}
+
+/*
+ * Harness.
+ */
+
+static volatile uint64_t sink;
+
+static void report(const char *name, size_t size, size_t ops, int64_t start) {
+    int64_t us = g_get_monotonic_time() - start;
+    char label[128];
+    if (size > 0)
+        snprintf(label, sizeof(label), "%s/%zu", name, size);
+    else
+        snprintf(label, sizeof(label), "%s", name);
+    printf("{\"bench\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.1f}\n",
+           label, ops, (double)us * 1000.0 / (double)ops);
+    fflush(stdout);
+}
+
+// xorshift; deterministic so runs are comparable.
+static uint32_t rng_state = 2463534242u;
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static void reset_ids(void) {
+    range *cr, *next;
+    for (cr = r; cr != NULL; cr = next) {
+        next = cr->next;
+        free(cr);
+    }
+    r = NULL;
+}
+
+static NLNote *make_note(uint32_t id) {
+    GVariantBuilder hb;
+    g_variant_builder_init(&hb, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&hb, "{sv}", "urgency", g_variant_new_byte(1));
+    g_variant_builder_add(&hb, "{sv}", "category", g_variant_new_string("im.received"));
+    g_variant_builder_add(&hb, "{sv}", "desktop-entry",
+                          g_variant_new_string("org.example.Chat"));
+    g_variant_builder_add(&hb, "{sv}", "image-path",
+                          g_variant_new_string("/usr/share/icons/chat.png"));
+    g_variant_builder_add(&hb, "{sv}", "resident", g_variant_new_boolean(0));
+    g_variant_builder_add(&hb, "{sv}", "transient", g_variant_new_boolean(0));
+    g_variant_builder_add(&hb, "{sv}", "x", g_variant_new_int32(100));
+    g_variant_builder_add(&hb, "{sv}", "y", g_variant_new_int32(200));
+    g_variant_builder_add(&hb, "{sv}", "value", g_variant_new_int32(42));
+    g_variant_builder_add(&hb, "{sv}", "x-dunst-stack-tag", g_variant_new_string("chat"));
+    GVariant *hv = g_variant_ref_sink(g_variant_builder_end(&hb));
+
+    NLHints *hints = new_hints(hv);
+    g_variant_unref(hv);
+
+#if NL_ACTIONS
+    char *acts[] = { "default", "Open", "reply", "Reply", "mute", "Mute",
+                     "archive", "Archive", "later", "Remind me later", NULL };
+    NLActions *actions = new_actions(g_strdupv(acts), 10);
+#endif
+
+    return new_note(id, intern_ref("Chat"), g_strdup("New message"),
+                    g_strdup("Hey, are you coming to the thing tonight?"),
+#if NL_ACTIONS
+                    actions,
+#endif
+#if NL_URGENCY
+                    URG_NORM,
+#endif
+#if NL_IMAGES
+                    NULL,
+#endif
+                    hints, -1);
+}
+
+static qnode *make_qn(uint32_t id, char *tag) {
+    qnode *qn = new_qn(id, QUEUE_NOTIFY);
+    qn->tag = tag;
+    return qn;
+}
+
+static void fill_queue(queue *q, size_t size, int tagged) {
+    size_t i;
+    for (i = 1; i <= size; i++)
+        queue_insert(q, make_qn(i, tagged ? g_strdup_printf("tag-%zu", i) : NULL));
+}
+
+static void empty_queue(queue *q) {
+    qnode *qn;
+    while ((qn = queue_yank_first(q)) != NULL)
+        free_qn(qn);
+}
+
+/*
+ * idrange.c
+ */
+
+static void bench_ids(void) {
+    const size_t n = 1000000;
+    size_t i;
+    int64_t start;
+
+    reset_ids();
+    start = g_get_monotonic_time();
+    for (i = 0; i < n; i++)
+        sink += get_unclaimed_id();
+    report("get_unclaimed_id/sequential", 0, n, start);
+
+    // Every other ID claimed: the worst case for the range list's length.
+    const size_t gaps = 10000;
+    reset_ids();
+    start = g_get_monotonic_time();
+    for (i = 1; i <= gaps; i++)
+        claim_id(2 * i);
+    report("claim_id/ascending_gaps", gaps, gaps, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < gaps; i++)
+        claim_id(2 * (rng() % gaps) + 2);
+    report("claim_id/reclaim_random", gaps, gaps, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < gaps; i++)
+        sink += get_unclaimed_id();
+    report("get_unclaimed_id/fill_gaps", gaps, gaps, start);
+
+    reset_ids();
+}
+
+/*
+ * queue.c
+ */
+
+static void bench_queue(size_t size) {
+    const size_t ops = 100000;
+    queue q = { .start = NULL, .end = NULL };
+    qnode *qn;
+    size_t i;
+    int64_t start;
+
+    start = g_get_monotonic_time();
+    fill_queue(&q, size, 0);
+    report("queue_insert", size, size, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += (uintptr_t)queue_find_id(&q, rng() % size + 1);
+    report("queue_find_id", size, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        qn = queue_yank_id(&q, rng() % size + 1);
+        queue_insert(&q, qn);
+    }
+    report("queue_yank_id+insert", size, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        qn = queue_yank_first(&q);
+        queue_insert(&q, qn);
+    }
+    report("queue_yank_first+insert", size, ops, start);
+
+    empty_queue(&q);
+}
+
+#if NL_TAGS
+static void bench_tags(size_t size) {
+    const size_t ops = 100000;
+    char **tags = ealloc(sizeof(char *) * ops);
+    size_t i;
+
+    fill_queue(&timeout_queue, size, 1);
+    for (i = 0; i < ops; i++)
+        tags[i] = g_strdup_printf("tag-%zu", rng() % size + 1);
+
+    int64_t start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += tag_to_id(tags[i]);
+    report("tag_to_id", size, ops, start);
+
+    for (i = 0; i < ops; i++)
+        g_free(tags[i]);
+    free(tags);
+    empty_queue(&timeout_queue);
+}
+#endif
+
+/*
+ * note.c
+ */
+
+static void bench_hints(void) {
+    const size_t ops = 1000000;
+    NLNote *n = make_note(1);
+    int i_out;
+    unsigned char b_out;
+    const char *s_out;
+    NLHint h;
+    size_t i;
+    int64_t start;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        nl_get_int_hint(n, "value", &i_out);
+        sink += i_out;
+    }
+    report("nl_get_int_hint", 0, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        nl_get_byte_hint(n, "urgency", &b_out);
+        sink += b_out;
+    }
+    report("nl_get_byte_hint", 0, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        nl_get_boolean_hint(n, "resident", &i_out);
+        sink += i_out;
+    }
+    report("nl_get_boolean_hint", 0, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        nl_get_string_hint(n, "desktop-entry", &s_out);
+        sink += (uintptr_t)s_out;
+    }
+    report("nl_get_string_hint", 0, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += nl_get_string_hint(n, "no-such-hint", &s_out);
+    report("nl_get_string_hint/missing", 0, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        nl_get_hint(n, "category", &h);
+        sink += h.type;
+    }
+    report("nl_get_hint", 0, ops, start);
+
+#if NL_STD_HINTS
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += nl_has_std_hint(n, STD_HINT_VALUE) ? n->std.value : 0;
+    report("std hint field", 0, ops, start);
+#endif
+
+#if NL_ACTIONS
+    static const char *keys[] = { "default", "reply", "later", "nope" };
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += (uintptr_t)nl_action_name(n, keys[i % 4]);
+    report("nl_action_name", 0, ops, start);
+#endif
+
+    free_note(n);
+}
+
+static void bench_note_churn(void) {
+    const size_t ops = 100000;
+    size_t i;
+
+    int64_t start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        free_note(make_note(i + 1));
+    report("new_note+free_note", 0, ops, start);
+}
+
+#if NL_MARKUP
+static void bench_markup(void) {
+    const size_t ops = 100000;
+    const char *body = "<b>Alice</b> sent you a <a href=\"https://example.com/m/1\">"
+                       "message</a> &amp; a photo: <img src=\"/tmp/p.png\" alt=\"photo\"/>"
+                       " <i>&quot;see you at 8&quot;</i>";
+    size_t i;
+
+    int64_t start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++) {
+        NLMarkup *m = markup_parse(body);
+        sink += m->nspans;
+        free(m);
+    }
+    report("markup_parse", 0, ops, start);
+}
+#endif
+
+#if NL_SEARCH
+static void bench_search(size_t size) {
+    static const char *words[] = {
+        "meeting", "build", "failed", "passed", "deploy", "message", "invite",
+        "reminder", "battery", "update", "download", "complete", "code",
+        "login", "alert", "backup", "calendar", "review", "merged", "comment"
+    };
+    const size_t ops = 10000;
+    unsigned int ids[50];
+    size_t i;
+    int64_t start;
+
+    for (i = 1; i <= size; i++) {
+        NLNote *n = make_note(i);
+        g_free(n->summary);
+        g_free(n->body);
+        n->summary = g_strdup_printf("%s %s", words[rng() % 20], words[rng() % 20]);
+        n->body = g_strdup_printf("%s %s %s %06u", words[rng() % 20],
+                                  words[rng() % 20], words[rng() % 20], rng() % 1000000);
+        search_add(n);
+        free_note(n);
+    }
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += nl_search("build failed", ids, 50);
+    report("nl_search/two_words", size, ops, start);
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < ops; i++)
+        sink += nl_search("code 12", ids, 50);
+    report("nl_search/prefix", size, ops, start);
+
+    for (i = 1; i <= size; i++)
+        search_close(i, 0);
+}
+#endif
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = { 100, 1000, 10000 };
+    size_t i;
+
+    bench_ids();
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+        bench_queue(sizes[i]);
+#if NL_TAGS
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+        bench_tags(sizes[i]);
+#endif
+    bench_hints();
+    bench_note_churn();
+#if NL_MARKUP
+    bench_markup();
+#endif
+#if NL_SEARCH
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++)
+        bench_search(sizes[i]);
+#endif
+
+    return 0;
+}
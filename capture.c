@@ -0,0 +1,128 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Capture of incoming calls to a trace file, for tools/nlreplay.
+ *
+ * A trace is CAPTURE_MAGIC and a uint32 CAPTURE_VERSION, followed by one
+ * record per call:
+ *
+ *   uint64  microseconds since capture started
+ *   uint8   kind (enum capture_kind)
+ *   uint32  ID the note was given, or the ID the call was about
+ *   uint32  length of the arguments
+ *   ...     the call's arguments, as serialized GVariant data
+ *
+ * all in host byte order.  Notify calls are recorded once decoded, so the ID
+ * is the one the client was given (0 if a rule dropped the note).
+ *
+ * Everything here runs on the D-Bus thread.  Writes are buffered, and flushed
+ * a second after the first unflushed record, so a quiet server isn't woken.
+ * If a write fails (say, the disk is full), capture stops with an error
+ * rather than carrying on with a trace that silently misses calls.  The trace
+ * holds every note's contents, so it's created readable only by its owner.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#define FLUSH_SECONDS 1
+
+static FILE *trace = NULL;
+static int64_t start = 0;
+static guint flush_source = 0;
+static const char *trace_path = NULL;
+
+extern int nl_set_capture_file(const char *path) {
+    if (trace != NULL) {
+        fclose(trace);
+        trace = NULL;
+    }
+    if (path == NULL)
+        return 1;
+
+    uint32_t version = CAPTURE_VERSION;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0 && (trace = fdopen(fd, "wb")) == NULL)
+        close(fd);
+    if (trace == NULL
+            || fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC), 1, trace) != 1
+            || fwrite(&version, sizeof(version), 1, trace) != 1) {
+        perror(path);
+        if (trace != NULL)
+            fclose(trace);
+        trace = NULL;
+        return 0;
+    }
+
+    trace_path = path;
+    start = g_get_monotonic_time();
+    return 1;
+}
+
+// Gives up on the trace after a failed write.
+static void capture_failed(void) {
+    perror(trace_path);
+    fprintf(stderr, "Stopped capturing to %s\n", trace_path);
+    fclose(trace);
+    trace = NULL;
+    if (flush_source != 0) {
+        remove_source(flush_source);
+        flush_source = 0;
+    }
+}
+
+static gboolean on_flush(gpointer data) {
+    flush_source = 0;
+    if (trace != NULL && fflush(trace) != 0)
+        capture_failed();
+    return G_SOURCE_REMOVE;
+}
+
+extern void capture_call(enum capture_kind kind, uint32_t id, GVariant *args) {
+    if (trace == NULL)
+        return;
+
+    uint64_t t = g_get_monotonic_time() - start;
+    uint8_t k = kind;
+    uint32_t len = g_variant_get_size(args);
+
+    if (fwrite(&t, sizeof(t), 1, trace) != 1
+            || fwrite(&k, sizeof(k), 1, trace) != 1
+            || fwrite(&id, sizeof(id), 1, trace) != 1
+            || fwrite(&len, sizeof(len), 1, trace) != 1
+            || fwrite(g_variant_get_data(args), 1, len, trace) != len) {
+        capture_failed();
+        return;
+    }
+
+    if (flush_source == 0)
+        flush_source = add_source(g_timeout_source_new_seconds(FLUSH_SECONDS),
+                                  on_flush);
+}
+
+extern void capture_flush(void) {
+    if (trace != NULL && fflush(trace) != 0)
+        capture_failed();
+}
@@ -23,14 +23,38 @@
  * https://developer.gnome.org/notification-spec/
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <gio/gio.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "notlib.h"
 #include "_notlib_internal.h"
 
 static GDBusConnection *dbus_conn;
+
+/* Connections from clients talking to us directly, rather than via the bus.
+ * Signals are emitted from the callback thread, so this needs a lock. */
+static const char *peer_socket = NULL;
+static GDBusServer *peer_server = NULL;
+static GList *peers = NULL;
+static pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
 static GDBusNodeInfo *introspection_data = NULL;
+static GMainLoop *loop = NULL;    /* NULL if attached to the caller's */
+static guint owner_id = 0;
+static int unicast = 0;
+
+/* While we wait for a predecessor's state, calls which would touch notes are
+ * held here; once our own state has been handed over, they're refused. */
+static int awaiting_state = 0;
+static int retired = 0;
+static GQueue deferred = G_QUEUE_INIT;
 
 static const char *dbus_introspection_xml =
     "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
@@ -71,6 +95,19 @@ static const char *dbus_introspection_xml =
     "            <arg direction=\"in\" name=\"key\" type=\"s\"/>"
     "        </method>"
 
+#endif
+
+#if NL_BATCH
+
+    "        <method name=\"NotifyBatch\">"
+    "            <arg direction=\"in\"  name=\"notes\"  type=\"a(susssasa{sv}i)\"/>"
+    "            <arg direction=\"out\" name=\"ids\"    type=\"au\"/>"
+    "        </method>"
+
+    "        <method name=\"CloseNotifications\">"
+    "            <arg direction=\"in\"  name=\"ids\"    type=\"au\"/>"
+    "        </method>"
+
 #endif
 
     "        <signal name=\"NotificationClosed\">"
@@ -92,6 +129,14 @@ static const char *dbus_introspection_xml =
 
 char **server_capabilities;
 
+/* Capabilities which notlib implements itself, on top of the server's. */
+static const char *notlib_capabilities[] = {
+#if NL_BATCH
+    "x-notlib-batch",
+#endif
+    NULL
+};
+
 static void get_capabilities(GDBusConnection *conn, const char *sender,
                              const GVariant *params,
                              GDBusMethodInvocation *invocation) {
@@ -107,6 +152,10 @@ static void get_capabilities(GDBusConnection *conn, const char *sender,
         g_variant_builder_add(builder, "s", *cap);
     }
 
+    const char **ncap;
+    for (ncap = notlib_capabilities; *ncap != NULL; ncap++)
+        g_variant_builder_add(builder, "s", *ncap);
+
     value = g_variant_new("(as)", builder);
     g_variant_builder_unref(builder);
     g_dbus_method_invocation_return_value(invocation, value);
@@ -119,6 +168,8 @@ static void close_notification(GDBusConnection *conn, const char *sender,
                                GDBusMethodInvocation *invocation) {
     guint32 id;
     g_variant_get(params, "(u)", &id);
+    capture_call(CAPTURE_CLOSE, id, params);
+    decode_drain();
 
     // TODO: return empty dbus error if note does not currently exist
 
@@ -128,6 +179,24 @@ static void close_notification(GDBusConnection *conn, const char *sender,
     g_dbus_connection_flush(conn, NULL, NULL, NULL);
 }
 
+#if NL_BATCH
+static void close_notifications(GDBusConnection *conn, const char *sender,
+                                GVariant *params,
+                                GDBusMethodInvocation *invocation) {
+    GVariant *ids = g_variant_get_child_value(params, 0);
+    gsize count;
+    const uint32_t *idv = g_variant_get_fixed_array(ids, &count, sizeof(uint32_t));
+    capture_call(CAPTURE_CLOSE_MANY, 0, params);
+    decode_drain();
+
+    queue_close_ids(idv, count, CLOSE_REASON_CLOSED);
+
+    g_variant_unref(ids);
+    g_dbus_method_invocation_return_value(invocation, NULL);
+    g_dbus_connection_flush(conn, NULL, NULL, NULL);
+}
+#endif
+
 #if NL_ACTIONS && NL_REMOTE_ACTIONS
 static void invoke_action(GDBusConnection *conn, const char *sender,
                           GVariant *params,
@@ -135,6 +204,8 @@ static void invoke_action(GDBusConnection *conn, const char *sender,
     guint32 id;
     gchar *key;
     g_variant_get(params, "(us)", &id, &key);
+    capture_call(CAPTURE_INVOKE_ACTION, id, params);
+    decode_drain();
 
     // TODO: return empty dbus error if note does not currently exist
     // or note does not have invoked action
@@ -179,40 +250,129 @@ static const char *tag_hints[] = {
     NULL
 };
 
-static GVariant *search_for_tag_hint(GVariant *hints) {
-    for (int i = 0; tag_hints[i] != NULL; i++) {
-        GVariant *v = g_variant_lookup_value(hints, tag_hints[i], G_VARIANT_TYPE_STRING);
-        if (v != NULL)
-            return v;
+// Returns a copy of the first tag hint in a Notify call's arguments, or NULL.
+static char *find_tag(GVariant *params) {
+    GVariant *hints = g_variant_get_child_value(params, 6);
+    char *tag = NULL;
+
+    for (int i = 0; tag == NULL && tag_hints[i] != NULL; i++) {
+        GVariant *v = g_variant_lookup_value(hints, tag_hints[i],
+                                             G_VARIANT_TYPE_STRING);
+        if (v != NULL) {
+            tag = g_variant_dup_string(v, NULL);
+            g_variant_unref(v);
+        }
     }
-    return NULL;
+    g_variant_unref(hints);
+    return tag;
 }
 #endif
 
-static void notify(GDBusConnection *conn, const char *sender,
-                   GVariant *params,
-                   GDBusMethodInvocation *invocation) {
-    char *appname = NULL;
-    uint32_t replaces_id = 0;
+/*
+ * Decoding a Notify call happens in two steps.  The first, resolve_notify,
+ * does only what is needed to give the note its ID, and must run on the D-Bus
+ * thread.  The second, build_note, copies everything out of the arguments
+ * into an NLNote, and touches nothing but the arguments, so it can run on any
+ * thread (see "Parallel decoding" below).
+ */
+
+typedef struct {
+    GVariant *params;   /* NULL if no note is to be built */
+    const char *sender;
+    uint32_t id;
+    rule_result rr;
+    char *tag;
+    uint32_t seq;       /* order in which notes are to be queued */
+    NLNote *note;
+} decoding;
+
+#if !NL_SINGLE_THREAD && NL_TAGS
+static uint32_t inflight_tag(const char *tag);
+#endif
+
+// Gives the note in one Notify call its ID.  Returns the ID; d->params is set
+// if a note is to be built for it, and left NULL if the call was folded into
+// an already-open note, or dropped by a rule (in which case the ID is 0).
+// Notes restored from a predecessor have been through its rules and dedup
+// already, so they skip ours.
+static uint32_t resolve_notify(GVariant *params, const char *sender, int restored,
+                               decoding *d) {
+    uint32_t replaces_id;
+    rule_result rr = { -1, -1, NULL };
+
+    d->params = NULL;
+    d->tag = NULL;
+    d->note = NULL;
+
+    if (!restored && rules_enabled() && rules_match(params, &rr))
+        return 0;
+
+    g_variant_get_child(params, 1, "u", &replaces_id);
+
+    uint64_t fp = 0;
+    if (!restored && dedup_enabled() && replaces_id == 0) {
+        fp = dedup_fingerprint(params);
+        uint32_t dup_id = dedup_lookup(fp, params, sender);
+        if (dup_id != 0)
+            return dup_id;
+    }
+
+#if NL_TAGS
+    char *tag = rr.tag != NULL ? g_strdup(rr.tag) : find_tag(params);
+    if (tag != NULL) {
+        uint32_t tag_id = 0;
+#if !NL_SINGLE_THREAD
+        tag_id = inflight_tag(tag);
+#endif
+        if (tag_id == 0)
+            tag_id = tag_to_id(tag);
+        if (tag_id != 0)
+            replaces_id = tag_id;
+    }
+    d->tag = tag;
+#endif
+
+    uint32_t n_id;
+    if (replaces_id != 0) {
+        claim_id(replaces_id);
+        n_id = replaces_id;
+        if (dedup_enabled())
+            dedup_forget(n_id);
+    } else {
+        n_id = get_unclaimed_id();
+    }
+
+    if (fp != 0)
+        dedup_record(fp, params, n_id);
+
+    d->params = g_variant_ref(params);
+    d->sender = sender != NULL ? intern_ref(sender) : NULL;
+    d->id = n_id;
+    d->rr = rr;
+    return n_id;
+}
+
+// Builds the note for a resolved Notify call.  Safe to call from any thread.
+static NLNote *build_note(decoding *d) {
+    const char *appname = NULL;
     char *summary = NULL;
     char *body = NULL;
 #if NL_ACTIONS
-    NLActions *actions = ealloc(sizeof(NLActions));
-    actions->count = 0;
-    actions->keys = NULL;
-    actions->names = NULL;
+    NLActions *actions = NULL;
 #endif
     int32_t timeout = -1;
 #if NL_URGENCY
     enum NLUrgency urgency = 1;
 #endif
-    char *tag = NULL;
+#if NL_IMAGES
+    NLImage *image = NULL;
+#endif
     NLHints *hints = NULL;
 
     {
         GVariantIter _iter;
         GVariantIter *iter = &_iter;
-        g_variant_iter_init(iter, params);
+        g_variant_iter_init(iter, d->params);
         GVariant *content;
 #if NL_URGENCY
         GVariant *dict_value;
@@ -222,42 +382,36 @@ static void notify(GDBusConnection *conn, const char *sender,
             switch (idx) {
             case 0:
                 if (g_variant_is_of_type(content, G_VARIANT_TYPE_STRING))
-                    appname = g_variant_dup_string(content, NULL);
-                break;
-            case 1:
-                if (g_variant_is_of_type(content, G_VARIANT_TYPE_UINT32))
-                    replaces_id = g_variant_get_uint32(content);
+                    appname = intern_ref(g_variant_get_string(content, NULL));
                 break;
+            case 1: break;  /* replaces_id -- already resolved */
             case 2: break;  /* icon -- not supported */
             case 3:
                 if (g_variant_is_of_type(content, G_VARIANT_TYPE_STRING))
-                    summary = g_variant_dup_string(content, NULL);
+                    summary = limit_summary(content);
                 break;
             case 4:
                 if (g_variant_is_of_type(content, G_VARIANT_TYPE_STRING))
-                    body = g_variant_dup_string(content, NULL);
+                    body = limit_body(content);
                 break;
             case 5:
 #if NL_ACTIONS
-                if (g_variant_is_of_type(content, G_VARIANT_TYPE_STRING_ARRAY))
-                    actions->actions = g_variant_dup_strv(content, &(actions->count));
+                if (g_variant_is_of_type(content, G_VARIANT_TYPE_STRING_ARRAY)) {
+                    size_t count;
+                    char **strv = limit_actions(content, &count);
+                    actions = new_actions(strv, count);
+                }
 #endif
                 break;
             case 6:
-                if (g_variant_is_of_type(content, G_VARIANT_TYPE_DICTIONARY)) {
-                    hints = ealloc(sizeof(NLHints));
-                    hints->dict = g_variant_dict_new(content);
+                if (g_variant_is_of_type(content, G_VARIANT_TYPE_VARDICT)) {
+                    hints = new_hints(content);
+#if NL_IMAGES
+                    image = image_from_hints(hints);
+#endif
 #if NL_URGENCY
-                    if ((dict_value = g_variant_lookup_value(content, "urgency", G_VARIANT_TYPE_BYTE))) {
+                    if ((dict_value = hints_lookup(hints, "urgency", G_VARIANT_TYPE_BYTE)))
                         urgency = g_variant_get_byte(dict_value);
-                        g_variant_unref(dict_value);
-                    }
-#endif
-#if NL_TAGS
-                    if ((dict_value = search_for_tag_hint(content))) {
-                        tag = g_variant_dup_string(dict_value, NULL);
-                        g_variant_unref(dict_value);
-                    }
 #endif
                 }
                 break;
@@ -271,73 +425,327 @@ static void notify(GDBusConnection *conn, const char *sender,
         }
     }
 
-#if NL_TAGS
-    if (tag != NULL)
-        replaces_id = tag_to_id(tag);
+    if (d->rr.timeout >= 0)
+        timeout = d->rr.timeout;
+#if NL_URGENCY
+    if (d->rr.urgency >= 0)
+        urgency = d->rr.urgency;
 #endif
 
-    uint32_t n_id;
-    if (replaces_id != 0) {
-        claim_id(replaces_id);
-        n_id = replaces_id;
-    } else {
-        n_id = get_unclaimed_id();
-    }
-
-#if NL_ACTIONS
-    if (actions->count < 1) {
-        free_actions(actions);
-        actions = NULL;
-    }
-#endif
+    if (appname == NULL)
+        appname = intern_ref("");
 
-    NLNote *note = new_note(n_id, appname, summary, body,
+    NLNote *note = new_note(d->id, appname, summary, body,
 #if NL_ACTIONS
                             actions,
 #endif
 #if NL_URGENCY
                             urgency,
+#endif
+#if NL_IMAGES
+                            image,
 #endif
                             hints,
                             timeout);
+    note->sender = d->sender;
+
+    g_variant_unref(d->params);
+    d->params = NULL;
+    return note;
+}
+
+// Decodes the arguments to one Notify call from sender (NULL if unknown), on
+// this thread, and gives the note an ID.  Returns the ID; *out is the new
+// note, or NULL if the call was folded into an already-open note, or dropped
+// by a rule (in which case the ID is 0).
+static uint32_t decode_notify(GVariant *params, const char *sender, int restored,
+                              NLNote **out, char **tag_out) {
+    decoding d;
+    uint32_t n_id = resolve_notify(params, sender, restored, &d);
+
+    *out = d.params != NULL ? build_note(&d) : NULL;
+    *tag_out = d.tag;
+    return n_id;
+}
+
+/**
+ * Parallel decoding.
+ *
+ * With nl_set_decode_threads, Notify calls are only resolved here, and the
+ * notes built on a pool of threads.  Each note is given a sequence number as
+ * it is resolved, and built notes wait in a reorder buffer until every note
+ * before them has been queued, so notes are queued in the order they came.
+ *
+ * Calls which touch notes already sent (closes, actions, batches) and
+ * handover first wait for the pool to drain, so that they never overtake a
+ * note still being built.  So does a duplicate, before checking whether the
+ * note it duplicates is still open.  Tags of notes still being built are
+ * tracked, so that a note replacing one by tag gets its ID.
+ */
+
+#if !NL_SINGLE_THREAD
+static unsigned int decode_threads = 0;
+static GThreadPool *decoders = NULL;
+
+static pthread_mutex_t reorder_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static uint32_t issued = 0;         /* sequence number of the next note */
+static uint32_t flushed = 0;        /* of the next note to be queued */
+static GHashTable *reorder = NULL;  /* seq -> built decoding */
+#if NL_TAGS
+static GHashTable *inflight = NULL; /* tag -> ID, of notes being built */
+#endif
+
+extern void nl_set_decode_threads(unsigned int n) {
+    decode_threads = n;
+}
+
+#if NL_TAGS
+static uint32_t inflight_tag(const char *tag) {
+    uint32_t id = 0;
+    if (decoders == NULL)
+        return 0;
+    pthread_mutex_lock(&reorder_lock);
+    id = GPOINTER_TO_UINT(g_hash_table_lookup(inflight, tag));
+    pthread_mutex_unlock(&reorder_lock);
+    return id;
+}
+#endif
+
+// Builds a note, then queues it and every built note after it which is next
+// in line, under a single lock acquisition.
+static void decode_worker(gpointer data, gpointer user_data) {
+    decoding *d = data;
+    d->note = build_note(d);
+
+    NLNote **notes;
+    char **tags;
+    size_t count = 0;
+
+    pthread_mutex_lock(&reorder_lock);
+    g_hash_table_insert(reorder, GUINT_TO_POINTER(d->seq), d);
+
+    notes = ealloc(sizeof(NLNote *) * (g_hash_table_size(reorder) + 1));
+    tags  = ealloc(sizeof(char *) * (g_hash_table_size(reorder) + 1));
+    while ((d = g_hash_table_lookup(reorder, GUINT_TO_POINTER(flushed)))) {
+        g_hash_table_remove(reorder, GUINT_TO_POINTER(flushed));
+#if NL_TAGS
+        if (d->tag != NULL
+                && GPOINTER_TO_UINT(g_hash_table_lookup(inflight, d->tag)) == d->id)
+            g_hash_table_remove(inflight, d->tag);
+#endif
+        notes[count] = d->note;
+        tags[count] = d->tag;
+        count++;
+        flushed++;
+        free(d);
+    }
+
+    // Queued before the lock is let go, so that the next run can't overtake
+    // this one.
+    queue_notify_batch(notes, tags, count);
+    if (flushed == issued)
+        pthread_cond_broadcast(&drained);
+    pthread_mutex_unlock(&reorder_lock);
+
+    free(notes);
+    free(tags);
+}
+
+// Hands a resolved note to the pool, or builds and queues it here if there is
+// no pool.
+static void decode_submit(decoding *d) {
+    if (decoders == NULL) {
+        queue_notify(build_note(d), d->tag);
+        return;
+    }
+
+    decoding *job = ealloc(sizeof(decoding));
+    *job = *d;
+
+    pthread_mutex_lock(&reorder_lock);
+    job->seq = issued++;
+#if NL_TAGS
+    if (job->tag != NULL)
+        g_hash_table_replace(inflight, g_strdup(job->tag), GUINT_TO_POINTER(job->id));
+#endif
+    pthread_mutex_unlock(&reorder_lock);
+
+    g_thread_pool_push(decoders, job, NULL);
+}
+
+// Waits until every note handed to the pool has been queued.
+extern void decode_drain(void) {
+    if (decoders == NULL)
+        return;
+    pthread_mutex_lock(&reorder_lock);
+    while (flushed != issued)
+        pthread_cond_wait(&drained, &reorder_lock);
+    pthread_mutex_unlock(&reorder_lock);
+}
+
+static void decode_start(void) {
+    GError *err = NULL;
+
+    if (decode_threads == 0)
+        return;
 
-    queue_notify(note, tag);
+    reorder = g_hash_table_new(g_direct_hash, g_direct_equal);
+#if NL_TAGS
+    inflight = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+#endif
+    decoders = g_thread_pool_new(decode_worker, NULL, decode_threads, TRUE, &err);
+    if (decoders == NULL) {
+        g_printerr("Could not start decode threads: %s\n", err->message);
+        g_error_free(err);
+    }
+}
+#else
+static void decode_submit(decoding *d) {
+    queue_notify(build_note(d), d->tag);
+}
+
+extern void decode_drain(void) {}
+#endif
+
+static void notify(GDBusConnection *conn, const char *sender,
+                   GVariant *params,
+                   GDBusMethodInvocation *invocation) {
+    decoding d;
+    uint32_t n_id = resolve_notify(params, sender, 0, &d);
+    capture_call(CAPTURE_NOTIFY, n_id, params);
+
+    if (d.params != NULL)
+        decode_submit(&d);
 
     GVariant *reply = g_variant_new("(u)", n_id);
     g_dbus_method_invocation_return_value(invocation, reply);
     g_dbus_connection_flush(conn, NULL, NULL, NULL);
 }
 
+#if NL_BATCH
+// Like Notify, but for many notes at once.  The notes are all decoded before
+// any of them are queued, so IDs for tags (and duplicates) are resolved
+// against the notes opened before this call, not others in the same batch.
+static void notify_batch(GDBusConnection *conn, const char *sender,
+                         GVariant *params,
+                         GDBusMethodInvocation *invocation) {
+    decode_drain();
+    GVariant *batch = g_variant_get_child_value(params, 0);
+    size_t count = g_variant_n_children(batch);
+
+    NLNote **notes = ealloc(sizeof(NLNote *) * (count + 1));
+    char **tags    = ealloc(sizeof(char *) * (count + 1));
+    size_t nnotes = 0;
+
+    GVariantBuilder ids;
+    g_variant_builder_init(&ids, G_VARIANT_TYPE("au"));
+
+    GVariantIter iter;
+    GVariant *args;
+    g_variant_iter_init(&iter, batch);
+    while ((args = g_variant_iter_next_value(&iter))) {
+        uint32_t n_id = decode_notify(args, sender, 0, &notes[nnotes], &tags[nnotes]);
+        capture_call(CAPTURE_NOTIFY, n_id, args);
+        if (notes[nnotes] != NULL)
+            nnotes++;
+        g_variant_builder_add(&ids, "u", n_id);
+        g_variant_unref(args);
+    }
+
+    queue_notify_batch(notes, tags, nnotes);
+    free(notes);
+    free(tags);
+    g_variant_unref(batch);
+
+    GVariant *reply = g_variant_new("(au)", &ids);
+    g_dbus_method_invocation_return_value(invocation, reply);
+    g_dbus_connection_flush(conn, NULL, NULL, NULL);
+}
+#endif
+
 /**
  * DBus signal logic
  */
 
-void signal_notification_closed(uint32_t id, enum CloseReason reason) {
-    if (reason < CLOSE_REASON_MIN || reason > CLOSE_REASON_MAX)
-        reason = CLOSE_REASON_UNKNOWN;
+extern void nl_set_unicast_signals(int on) {
+    unicast = on;
+}
 
-    GVariant *body = g_variant_new("(uu)", id, reason);
+// Emits a run of signals with the same name to the bus and to every peer.
+// Takes ownership of the (floating) bodies.  With unicast signals, a signal
+// with a destination is sent only to that name on the bus, and only signals
+// without one (e.g. for notes from peers) go to peers.  dests may be NULL if
+// no signal has a destination.
+static void emit_signals(const char *name, GVariant **bodies,
+                         const char **dests, size_t count) {
     GError *err = NULL;
-    g_dbus_connection_emit_signal(dbus_conn, NULL, FDN_PATH, FDN_IFAC,
-            "NotificationClosed", body, &err);
+    GList *p;
+    size_t i;
 
-    if (err != NULL) {
-        fprintf(stderr, "Could not emit NotificationClosed signal: %s\n", err->message);
-        g_error_free(err);
+    for (i = 0; i < count; i++)
+        g_variant_ref_sink(bodies[i]);
+
+    if (dbus_conn != NULL) {
+        for (i = 0; i < count; i++) {
+            const char *dest = unicast && dests != NULL ? dests[i] : NULL;
+            g_dbus_connection_emit_signal(dbus_conn, dest, FDN_PATH, FDN_IFAC,
+                    name, bodies[i], &err);
+            if (err != NULL) {
+                fprintf(stderr, "Could not emit %s signal: %s\n", name, err->message);
+                g_clear_error(&err);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&peers_lock);
+    for (p = peers; p != NULL; p = p->next) {
+        for (i = 0; i < count; i++) {
+            if (unicast && dests != NULL && dests[i] != NULL)
+                continue;
+            g_dbus_connection_emit_signal(p->data, NULL, FDN_PATH, FDN_IFAC,
+                    name, bodies[i], &err);
+            if (err != NULL) {
+                fprintf(stderr, "Could not emit %s signal to peer: %s\n", name, err->message);
+                g_clear_error(&err);
+            }
+        }
     }
+    pthread_mutex_unlock(&peers_lock);
+
+    for (i = 0; i < count; i++)
+        g_variant_unref(bodies[i]);
 }
 
-#if NL_ACTIONS
-void signal_action_invoked(uint32_t id, const char *key) {
-    GVariant *body = g_variant_new("(us)", id, key);
-    GError *err = NULL;
-    g_dbus_connection_emit_signal(dbus_conn, NULL, FDN_PATH, FDN_IFAC,
-            "ActionInvoked", body, &err);
+static void emit_signal(const char *name, GVariant *body, const char *dest) {
+    emit_signals(name, &body, &dest, 1);
+}
 
-    if (err != NULL) {
-        fprintf(stderr, "Could not emit ActionInvoked signal: %s\n", err->message);
-        g_error_free(err);
-    }
+void signal_notification_closed(uint32_t id, const char *dest,
+                                enum CloseReason reason) {
+    if (reason < CLOSE_REASON_MIN || reason > CLOSE_REASON_MAX)
+        reason = CLOSE_REASON_UNKNOWN;
+
+    emit_signal("NotificationClosed", g_variant_new("(uu)", id, reason), dest);
+}
+
+void signal_notifications_closed(const uint32_t *ids, const char **dests,
+                                 size_t count, enum CloseReason reason) {
+    if (reason < CLOSE_REASON_MIN || reason > CLOSE_REASON_MAX)
+        reason = CLOSE_REASON_UNKNOWN;
+
+    GVariant **bodies = ealloc(sizeof(GVariant *) * (count + 1));
+    size_t i;
+    for (i = 0; i < count; i++)
+        bodies[i] = g_variant_new("(uu)", ids[i], reason);
+
+    emit_signals("NotificationClosed", bodies, dests, count);
+    free(bodies);
+}
+
+#if NL_ACTIONS
+void signal_action_invoked(uint32_t id, const char *dest, const char *key) {
+    emit_signal("ActionInvoked", g_variant_new("(us)", id, key), dest);
 }
 #endif
 
@@ -353,10 +761,29 @@ void handle_method_call(GDBusConnection *conn,
                         GVariant *params,
                         GDBusMethodInvocation *invocation,
                         gpointer user_data) {
+    if (retired) {
+        g_dbus_method_invocation_return_dbus_error(invocation,
+                "org.freedesktop.DBus.Error.ServiceUnknown",
+                "This server has handed over to its replacement");
+        return;
+    }
+    if (awaiting_state
+            && g_strcmp0(method_name, "GetCapabilities") != 0
+            && g_strcmp0(method_name, "GetServerInformation") != 0) {
+        g_queue_push_tail(&deferred, invocation);
+        return;
+    }
+
     if (g_strcmp0(method_name, "GetCapabilities") == 0) {
         get_capabilities(conn, sender, params, invocation);
     } else if (g_strcmp0(method_name, "Notify") == 0) {
         notify(conn, sender, params, invocation);
+#if NL_BATCH
+    } else if (g_strcmp0(method_name, "NotifyBatch") == 0) {
+        notify_batch(conn, sender, params, invocation);
+    } else if (g_strcmp0(method_name, "CloseNotifications") == 0) {
+        close_notifications(conn, sender, params, invocation);
+#endif
     } else if (g_strcmp0(method_name, "CloseNotification") == 0) {
         close_notification(conn, sender, params, invocation);
     } else if (g_strcmp0(method_name, "GetServerInformation") == 0) {
@@ -375,8 +802,7 @@ static const GDBusInterfaceVTable interface_vtable = {
     handle_method_call
 };
 
-static void on_bus_acquired(GDBusConnection *conn, const char *name,
-                            gpointer user_data) {
+static int register_object(GDBusConnection *conn) {
     guint reg_id;
     GError *err = NULL;
 
@@ -387,7 +813,14 @@ static void on_bus_acquired(GDBusConnection *conn, const char *name,
 
     if (reg_id == 0) {
         g_printerr("Failed to register object: %s\n", err->message);
+        g_error_free(err);
     }
+    return reg_id != 0;
+}
+
+static void on_bus_acquired(GDBusConnection *conn, const char *name,
+                            gpointer user_data) {
+    register_object(conn);
 }
 
 static void on_name_acquired(GDBusConnection *conn, const char *name,
@@ -399,29 +832,255 @@ static void on_name_acquired(GDBusConnection *conn, const char *name,
 static void on_name_lost(GDBusConnection *conn, const char *name,
                          gpointer user_data) {
     g_printerr("Lost name %s on the session bus\n", name);
+
+    if (retired || !handover_pending())
+        return;
+
+    // Our successor has the name now; anything already sent to us has been
+    // queued once the decode threads are done with it, so our state is
+    // complete once the callback thread gets here.
+    retired = 1;
+    if (peer_server != NULL) {
+        // Dropping it closes the socket, which our successor waits to see.
+        g_dbus_server_stop(peer_server);
+        g_object_unref(peer_server);
+        peer_server = NULL;
+    }
+    decode_drain();
+    queue_handover();
 }
 
-// Entry point to D-Bus-listening thread.
+/**
+ * Handover.
+ */
 
-extern void *run_dbus_loop(void *_) {
-    GMainLoop *loop;
-    guint owner_id;
+static void start_peer_server(void);
+
+// Takes on a predecessor's state, or starts afresh if state is NULL, then
+// answers the calls which came in while we waited for it.
+extern void dbus_restore(GVariant *state) {
+    if (state != NULL && !handover_state_valid(state)) {
+        g_printerr("Ignoring predecessor's state, of an unknown version\n");
+        state = NULL;
+    }
+
+    // Our predecessor, if any, has stopped writing to it, and stopped
+    // listening on the peer socket.
+    shm_start();
+    if (peer_socket != NULL) {
+        if (main_context != NULL)
+            g_main_context_push_thread_default(main_context);
+        start_peer_server();
+        if (main_context != NULL)
+            g_main_context_pop_thread_default(main_context);
+    }
+
+    if (state != NULL) {
+        GVariant *ranges = g_variant_get_child_value(state, 1);
+        GVariant *batch  = g_variant_get_child_value(state, 2);
+        GVariantIter iter;
+        GVariant *args;
+        uint32_t min, max;
+
+        g_variant_iter_init(&iter, ranges);
+        while (g_variant_iter_next(&iter, "(uu)", &min, &max))
+            claim_range(min, max);
+
+        size_t count = g_variant_n_children(batch);
+        NLNote **notes = ealloc(sizeof(NLNote *) * (count + 1));
+        char **tags    = ealloc(sizeof(char *) * (count + 1));
+        size_t nnotes = 0;
+
+        g_variant_iter_init(&iter, batch);
+        while ((args = g_variant_iter_next_value(&iter))) {
+            decode_notify(args, NULL, 1, &notes[nnotes], &tags[nnotes]);
+            if (notes[nnotes] != NULL)
+                nnotes++;
+            g_variant_unref(args);
+        }
+
+        queue_notify_batch(notes, tags, nnotes);
+        g_printerr("Took over %zu notes from predecessor\n", nnotes);
+
+        free(notes);
+        free(tags);
+        g_variant_unref(batch);
+        g_variant_unref(ranges);
+    }
+
+    awaiting_state = 0;
+
+    GDBusMethodInvocation *inv;
+    while ((inv = g_queue_pop_head(&deferred)))
+        handle_method_call(g_dbus_method_invocation_get_connection(inv),
+                           g_dbus_method_invocation_get_sender(inv),
+                           g_dbus_method_invocation_get_object_path(inv),
+                           g_dbus_method_invocation_get_interface_name(inv),
+                           g_dbus_method_invocation_get_method_name(inv),
+                           g_dbus_method_invocation_get_parameters(inv),
+                           inv, NULL);
+}
+
+// Stops the D-Bus thread.  Safe to call from any thread.  If we're attached
+// to the caller's context, just gives up the bus name, since the caller's
+// loop is theirs to stop.
+extern void dbus_stop(void) {
+    if (loop != NULL) {
+        g_main_loop_quit(loop);
+    } else if (owner_id != 0) {
+        g_bus_unown_name(owner_id);
+        owner_id = 0;
+        capture_flush();
+    }
+}
+
+/**
+ * Peer-to-peer connections.
+ *
+ * Clients which send a lot of notifications can skip the bus daemon entirely
+ * by connecting straight to a private socket, which serves the same interface
+ * as we do on the bus.  Notes from both sources share one ID space and queue,
+ * since everything is handled on this same thread.
+ */
+
+extern void nl_set_peer_socket(const char *path) {
+    peer_socket = path;
+}
+
+static void on_peer_closed(GDBusConnection *conn, gboolean vanished,
+                           GError *err, gpointer user_data) {
+    pthread_mutex_lock(&peers_lock);
+    peers = g_list_remove(peers, conn);
+    pthread_mutex_unlock(&peers_lock);
+
+    g_object_unref(conn);
+}
+
+static gboolean on_new_peer(GDBusServer *server, GDBusConnection *conn,
+                            gpointer user_data) {
+    if (!register_object(conn))
+        return FALSE;
+
+    g_object_ref(conn);
+    g_signal_connect(conn, "closed", G_CALLBACK(on_peer_closed), NULL);
+
+    pthread_mutex_lock(&peers_lock);
+    peers = g_list_prepend(peers, conn);
+    pthread_mutex_unlock(&peers_lock);
+
+    return TRUE;
+}
+
+// Whether a server is listening on the socket at path.
+static int socket_in_use(const char *path) {
+    struct sockaddr_un addr;
+    int in_use = 0;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 0;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        in_use = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+    }
+    return in_use;
+}
+
+static void start_peer_server(void) {
+    struct stat st;
+    GError *err = NULL;
+
+    // Clear out a socket left behind by a previous run, but never one that
+    // another server is still listening on.
+    if (stat(peer_socket, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        if (socket_in_use(peer_socket)) {
+            g_printerr("Could not listen on %s: another server is listening on it\n",
+                       peer_socket);
+            return;
+        }
+        unlink(peer_socket);
+    }
+
+    char *path = g_dbus_address_escape_value(peer_socket);
+    char *addr = g_strdup_printf("unix:path=%s", path);
+    char *guid = g_dbus_generate_guid();
+
+    peer_server = g_dbus_server_new_sync(addr,
+            G_DBUS_SERVER_FLAGS_AUTHENTICATION_REQUIRE_SAME_USER,
+            guid, NULL, NULL, &err);
+
+    if (peer_server == NULL) {
+        g_printerr("Could not listen on %s: %s\n", peer_socket, err->message);
+        g_error_free(err);
+    } else {
+        g_signal_connect(peer_server, "new-connection",
+                         G_CALLBACK(on_new_peer), NULL);
+        g_dbus_server_start(peer_server);
+    }
+
+    g_free(guid);
+    g_free(addr);
+    g_free(path);
+}
+
+// Starts listening on the bus (and peer socket), on main_context.  GIO hands
+// each source to the thread-default context when it is created, so ours is
+// made the thread default while they are.
+
+extern void dbus_start(void) {
+    GBusNameOwnerFlags flags = G_BUS_NAME_OWNER_FLAGS_NONE;
+
+    if (main_context != NULL)
+        g_main_context_push_thread_default(main_context);
 
     introspection_data = g_dbus_node_info_new_for_xml(dbus_introspection_xml,
                                                       NULL);
+#if !NL_SINGLE_THREAD
+    decode_start();
+#endif
+
+    if (handover_enabled()) {
+        flags |= G_BUS_NAME_OWNER_FLAGS_ALLOW_REPLACEMENT;
+        if (handover_connect()) {
+            flags |= G_BUS_NAME_OWNER_FLAGS_REPLACE;
+            awaiting_state = 1;
+        } else {
+            handover_listen();
+        }
+    }
+    if (!awaiting_state)
+        shm_start();
 
     owner_id = g_bus_own_name(G_BUS_TYPE_SESSION,
                               FDN_NAME,
-                              G_BUS_NAME_OWNER_FLAGS_NONE,
+                              flags,
                               on_bus_acquired,
                               on_name_acquired,
                               on_name_lost,
                               NULL, NULL);
 
-    loop = g_main_loop_new(NULL, FALSE);
+    // A predecessor keeps its peer socket until it hands over.
+    if (peer_socket != NULL && !awaiting_state)
+        start_peer_server();
+
+    if (main_context != NULL)
+        g_main_context_pop_thread_default(main_context);
+}
+
+// Entry point to D-Bus-listening thread.
+
+extern void *run_dbus_loop(void *_) {
+    loop = g_main_loop_new(main_context, FALSE);
+    dbus_start();
+
     g_main_loop_run(loop);
 
     g_bus_unown_name(owner_id);
+    capture_flush();
 
     return NULL;
 }
@@ -0,0 +1,196 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Some clients send the same notification many times in quick succession.
+ * When a dedup window is set, each Notify is fingerprinted before it is
+ * decoded; if an identical notification was opened within the window and is
+ * still open, the client is handed that note's ID (and the note's expiry is
+ * pushed back) instead of getting a brand new note.  Each note's call is kept
+ * for the length of the window, so that a matching fingerprint can be checked
+ * against the call's contents, rather than trusted.
+ *
+ * Everything here runs on the D-Bus thread.  The window is set before
+ * notlib_run, and only read once it has started.
+ */
+
+#include <stdint.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+typedef struct {
+    uint64_t fp;
+    uint32_t id;
+    int64_t time;
+    GVariant *params;
+} seen;
+
+static uint32_t window = 0;
+static GHashTable *by_fp = NULL;    /* fingerprint -> most recent seen */
+static GHashTable *by_id = NULL;    /* ID -> most recent seen */
+static GQueue by_time = G_QUEUE_INIT;
+
+extern void nl_set_dedup_window(unsigned int ms) {
+    window = ms;
+}
+
+extern int dedup_enabled(void) {
+    return window > 0;
+}
+
+/*
+ * Fingerprinting
+ */
+
+#define FNV_PRIME 0x100000001b3ULL
+
+static uint64_t hash_bytes(uint64_t h, const void *p, size_t len) {
+    const unsigned char *c = p;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ c[i]) * FNV_PRIME;
+    return h;
+}
+
+// Containers are walked rather than serialized, since the values GDBus hands
+// us are not necessarily in serialized form.
+static uint64_t hash_value(uint64_t h, GVariant *v) {
+    const char *type = g_variant_get_type_string(v);
+    h = hash_bytes(h, type, strlen(type));
+
+    if (!g_variant_is_container(v))
+        return hash_bytes(h, g_variant_get_data(v), g_variant_get_size(v));
+
+    if (g_variant_is_of_type(v, G_VARIANT_TYPE_BYTESTRING)) {
+        gsize len;
+        const void *data = g_variant_get_fixed_array(v, &len, 1);
+        return hash_bytes(h, data, len);
+    }
+
+    GVariantIter iter;
+    GVariant *child;
+    g_variant_iter_init(&iter, v);
+    while ((child = g_variant_iter_next_value(&iter))) {
+        h = hash_value(h, child);
+        g_variant_unref(child);
+    }
+    return h;
+}
+
+// The fields of a Notify call which count: the app name, summary, body,
+// actions and hints.  The icon, replaces_id and timeout don't.
+static const int fields[] = { 0, 3, 4, 5, 6 };
+
+// Fingerprints the fields of a Notify call which count.
+extern uint64_t dedup_fingerprint(GVariant *params) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < G_N_ELEMENTS(fields); i++) {
+        GVariant *v = g_variant_get_child_value(params, fields[i]);
+        h = hash_value(h, v);
+        g_variant_unref(v);
+    }
+    return h;
+}
+
+// Whether two Notify calls match in every field which counts.
+static int same_contents(GVariant *a, GVariant *b) {
+    size_t i;
+    int same = 1;
+
+    for (i = 0; same && i < G_N_ELEMENTS(fields); i++) {
+        GVariant *x = g_variant_get_child_value(a, fields[i]);
+        GVariant *y = g_variant_get_child_value(b, fields[i]);
+        same = g_variant_equal(x, y);
+        g_variant_unref(x);
+        g_variant_unref(y);
+    }
+    return same;
+}
+
+/*
+ * The window itself
+ */
+
+static void expire_seen(int64_t now) {
+    seen *s;
+    while ((s = g_queue_peek_head(&by_time)) && now - s->time > window) {
+        g_queue_pop_head(&by_time);
+        if (g_hash_table_lookup(by_fp, &s->fp) == s)
+            g_hash_table_remove(by_fp, &s->fp);
+        if (g_hash_table_lookup(by_id, GUINT_TO_POINTER(s->id)) == s)
+            g_hash_table_remove(by_id, GUINT_TO_POINTER(s->id));
+        g_variant_unref(s->params);
+        free(s);
+    }
+}
+
+// Returns the ID of a still-open note with the given fingerprint and contents
+// which was opened within the window, having refreshed that note's expiry, or
+// 0.  If sender isn't the note's own, the note's signals are broadcast from
+// then on, so that both clients hear of it.
+extern uint32_t dedup_lookup(uint64_t fp, GVariant *params, const char *sender) {
+    if (by_fp == NULL)
+        return 0;
+
+    expire_seen(g_get_monotonic_time() / 1000);
+
+    seen *s = g_hash_table_lookup(by_fp, &fp);
+    if (s == NULL || !same_contents(s->params, params))
+        return 0;
+
+    // The note it duplicates may not have been queued yet.
+    decode_drain();
+    if (!queue_refresh(s->id, sender))
+        return 0;
+    return s->id;
+}
+
+extern void dedup_record(uint64_t fp, GVariant *params, uint32_t id) {
+    if (by_fp == NULL) {
+        by_fp = g_hash_table_new(g_int64_hash, g_int64_equal);
+        by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    }
+
+    seen *s = ealloc(sizeof(seen));
+    s->fp = fp;
+    s->id = id;
+    s->time = g_get_monotonic_time() / 1000;
+    s->params = g_variant_ref(params);
+
+    expire_seen(s->time);
+    g_hash_table_replace(by_fp, &s->fp, s);
+    g_hash_table_replace(by_id, GUINT_TO_POINTER(id), s);
+    g_queue_push_tail(&by_time, s);
+}
+
+// A note has been replaced, so it no longer shows what was recorded for its
+// ID, and a repeat of that call is no duplicate of it.  The entry stays
+// queued until it expires, but can no longer be found.
+extern void dedup_forget(uint32_t id) {
+    if (by_id == NULL)
+        return;
+
+    seen *s = g_hash_table_lookup(by_id, GUINT_TO_POINTER(id));
+    if (s == NULL)
+        return;
+    g_hash_table_remove(by_id, GUINT_TO_POINTER(id));
+    if (g_hash_table_lookup(by_fp, &s->fp) == s)
+        g_hash_table_remove(by_fp, &s->fp);
+}
@@ -0,0 +1,311 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Handing a running server's state over to its replacement, so that a
+ * restart neither drops open notes nor leaves the bus name unowned.
+ *
+ *  1. The new server connects to the old one's handover socket, then asks
+ *     for the bus name with the REPLACE flag.  Until it has the old server's
+ *     state, it holds on to incoming method calls without answering them.
+ *  2. The bus gives the name straight to the new server, and tells the old
+ *     one it lost the name.  Anything sent to the name before that point was
+ *     delivered to the old server first, and will be handled before it sees
+ *     NameLost.
+ *  3. The old server finishes the events already queued, then writes its
+ *     claimed IDs and open notes to the socket, and shuts down.
+ *  4. The new server restores the state, answers the calls it held, and
+ *     starts listening on the handover socket itself.
+ *
+ * State is a GVariant of type (ua(uu)a(susssasa{sv}i)): a format version, the
+ * claimed ID ranges, and the open notes, each in the form of the arguments to
+ * a Notify call replacing itself.
+ *
+ * The socket is only accessible to its owner, and each side checks that the
+ * other is running as the same user before trusting it with (or taking) state.
+ */
+
+// For SO_PEERCRED and struct ucred.
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib-unix.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#define HANDOVER_VERSION 1
+#define HANDOVER_TYPE "(ua(uu)a(susssasa{sv}i))"
+
+/* How long to wait for a predecessor's state before giving up on it. */
+#define HANDOVER_WAIT_MS 5000
+
+static const char *socket_path = NULL;
+static int listen_fd = -1;
+static int successor_fd = -1;
+static int predecessor_fd = -1;
+static guint wait_source = 0;
+static guint state_source = 0;
+
+extern void nl_set_handover_socket(const char *path) {
+    socket_path = path;
+}
+
+extern int handover_enabled(void) {
+    return socket_path != NULL;
+}
+
+static int socket_address(struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Handover socket path is too long: %s\n", socket_path);
+        return 0;
+    }
+    strcpy(addr->sun_path, socket_path);
+    return 1;
+}
+
+// Like write, but a successor which has hung up makes it fail with EPIPE
+// rather than killing us with SIGPIPE.
+static int send_all(int fd, const void *p, size_t len) {
+    const char *c = p;
+    while (len > 0) {
+        ssize_t w = send(fd, c, len, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            return 0;
+        c += w;
+        len -= w;
+    }
+    return 1;
+}
+
+static int read_all(int fd, void *p, size_t len) {
+    char *c = p;
+    while (len > 0) {
+        ssize_t r = read(fd, c, len);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 0;
+        c += r;
+        len -= r;
+    }
+    return 1;
+}
+
+// Whether the process at the other end of a connection runs as our user.
+static int peer_is_us(int fd) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        perror("handover peer credentials");
+        return 0;
+    }
+    if (cred.uid != getuid()) {
+        fprintf(stderr, "Rejecting handover peer with uid %u\n", (unsigned)cred.uid);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * The old server's side.
+ */
+
+static void accept_successor(void) {
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn < 0)
+        return;
+
+    if (!peer_is_us(conn)) {
+        close(conn);
+    } else if (successor_fd >= 0) {
+        // Only one replacement at a time.
+        close(conn);
+    } else {
+        successor_fd = conn;
+    }
+}
+
+static gboolean on_successor(gint fd, GIOCondition cond, gpointer data) {
+    accept_successor();
+    return G_SOURCE_CONTINUE;
+}
+
+// Whether a successor is waiting for our state.  The bus may tell us we've
+// lost our name before we've got round to accepting the successor's
+// connection, so this checks for one too.
+extern int handover_pending(void) {
+    if (successor_fd < 0 && listen_fd >= 0)
+        accept_successor();
+    return successor_fd >= 0;
+}
+
+// Starts listening for a successor.
+extern void handover_listen(void) {
+    struct sockaddr_un addr;
+    struct stat st;
+
+    if (!socket_address(&addr))
+        return;
+
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0
+            || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || chmod(socket_path, 0600) < 0
+            || listen(listen_fd, 1) < 0
+            || fcntl(listen_fd, F_SETFL, O_NONBLOCK) < 0) {
+        perror("handover socket");
+        if (listen_fd >= 0)
+            close(listen_fd);
+        listen_fd = -1;
+        return;
+    }
+
+    add_source(g_unix_fd_source_new(listen_fd, G_IO_IN),
+               G_SOURCE_FUNC(on_successor));
+}
+
+// Sends our state to the successor.  Called from the callback thread, once
+// nothing else is going to change it.
+extern void handover_send(GVariant *state) {
+    g_variant_ref_sink(state);
+
+    uint32_t len = g_variant_get_size(state);
+    if (!send_all(successor_fd, &len, sizeof(len))
+            || !send_all(successor_fd, g_variant_get_data(state), len)) {
+        if (errno == EPIPE)
+            fprintf(stderr, "Successor hung up before taking our state\n");
+        else
+            perror("handover write");
+    }
+
+    close(successor_fd);
+    successor_fd = -1;
+    g_variant_unref(state);
+}
+
+/*
+ * The new server's side.
+ */
+
+static void finish_waiting(GVariant *state) {
+    if (wait_source != 0) {
+        remove_source(wait_source);
+        wait_source = 0;
+    }
+    if (state_source != 0) {
+        remove_source(state_source);
+        state_source = 0;
+    }
+    if (predecessor_fd >= 0) {
+        close(predecessor_fd);
+        predecessor_fd = -1;
+    }
+
+    dbus_restore(state);
+    handover_listen();
+}
+
+static gboolean on_state(gint fd, GIOCondition cond, gpointer data) {
+    GVariant *state = NULL;
+    uint32_t len;
+
+    if (read_all(fd, &len, sizeof(len))) {
+        char *buf = g_malloc(len ? len : 1);
+        if (read_all(fd, buf, len)) {
+            state = g_variant_new_from_data(G_VARIANT_TYPE(HANDOVER_TYPE),
+                                            buf, len, FALSE, g_free, buf);
+            g_variant_ref_sink(state);
+        } else {
+            g_free(buf);
+        }
+    }
+
+    if (state == NULL)
+        fprintf(stderr, "Predecessor closed the handover socket without sending its state\n");
+
+    state_source = 0;
+    finish_waiting(state);
+    if (state != NULL)
+        g_variant_unref(state);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean on_wait_timeout(gpointer data) {
+    fprintf(stderr, "Timed out waiting for predecessor's state\n");
+    wait_source = 0;
+    finish_waiting(NULL);
+    return G_SOURCE_REMOVE;
+}
+
+// Connects to a running predecessor, if there is one.  If so, returns true,
+// and dbus_restore will be called once its state arrives (or doesn't).
+extern int handover_connect(void) {
+    struct sockaddr_un addr;
+
+    if (!socket_address(&addr))
+        return 0;
+
+    predecessor_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (predecessor_fd < 0)
+        return 0;
+    if (connect(predecessor_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+            || !peer_is_us(predecessor_fd)) {
+        close(predecessor_fd);
+        predecessor_fd = -1;
+        return 0;
+    }
+
+    state_source = add_source(g_unix_fd_source_new(predecessor_fd,
+                                                   G_IO_IN | G_IO_HUP | G_IO_ERR),
+                              G_SOURCE_FUNC(on_state));
+    wait_source = add_source(g_timeout_source_new(HANDOVER_WAIT_MS),
+                             on_wait_timeout);
+    return 1;
+}
+
+// Builds our state, for handover_send.
+extern GVariant *handover_state(GVariant *notes) {
+    GVariantBuilder ranges;
+    g_variant_builder_init(&ranges, G_VARIANT_TYPE("a(uu)"));
+    idrange_snapshot(&ranges);
+
+    return g_variant_new("(ua(uu)@a(susssasa{sv}i))",
+                         HANDOVER_VERSION, &ranges, notes);
+}
+
+// Checks that a received state is one we understand.
+extern int handover_state_valid(GVariant *state) {
+    guint32 version;
+    g_variant_get_child(state, 0, "u", &version);
+    return version == HANDOVER_VERSION;
+}
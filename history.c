@@ -0,0 +1,213 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A history of closed notes, kept in a fixed-size, preallocated ring buffer.
+ * Each entry is a small header followed by the note's app name, summary and
+ * body, packed end to end.  Entries are never split across the end of the
+ * buffer; when one doesn't fit, writing wraps around to the start, and the
+ * oldest entries are evicted to make room.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+typedef struct {
+    uint32_t id;
+    uint32_t reason;
+    int64_t opened;
+    int64_t closed;
+    int32_t urgency;
+    uint32_t applen;    /* string lengths include the NUL */
+    uint32_t sumlen;
+    uint32_t bodylen;
+} entry;
+
+#define ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *buf = NULL;
+static size_t cap = 0;
+static size_t tail = 0;             /* where the next entry goes */
+static GQueue live = G_QUEUE_INIT;  /* offsets of entries, oldest first */
+static GHashTable *by_id = NULL;    /* id -> offset + 1 of latest entry */
+static void (*on_evict)(uint32_t) = NULL;
+
+static entry *entry_at(size_t off) {
+    return (entry *)(buf + off);
+}
+
+static size_t entry_size(const entry *e) {
+    return ALIGN(sizeof(entry) + e->applen + e->sumlen + e->bodylen);
+}
+
+static void evict_oldest(void) {
+    size_t off = GPOINTER_TO_UINT(g_queue_pop_head(&live));
+    entry *e = entry_at(off);
+
+    if (GPOINTER_TO_UINT(g_hash_table_lookup(by_id, GUINT_TO_POINTER(e->id))) == off + 1) {
+        g_hash_table_remove(by_id, GUINT_TO_POINTER(e->id));
+        if (on_evict != NULL)
+            on_evict(e->id);
+    }
+}
+
+static void clear(void) {
+    while (!g_queue_is_empty(&live))
+        evict_oldest();
+    tail = 0;
+}
+
+extern void nl_set_history_size(size_t bytes) {
+    pthread_mutex_lock(&history_lock);
+    if (by_id == NULL)
+        by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    clear();
+    free(buf);
+    buf = bytes ? ealloc(bytes) : NULL;
+    cap = bytes;
+    pthread_mutex_unlock(&history_lock);
+}
+
+// Called with the ID of each note that falls out of the history for good.
+extern void history_set_evict_hook(void (*hook)(uint32_t)) {
+    on_evict = hook;
+}
+
+extern int history_enabled(void) {
+    return cap > 0;
+}
+
+static int overlaps(size_t off, size_t start, size_t size) {
+    size_t end = off + entry_size(entry_at(off));
+    return off < start + size && start < end;
+}
+
+static void put_str(char **p, const char *s, uint32_t len) {
+    if (len > 0)
+        memcpy(*p, s, len);
+    *p += len;
+}
+
+static uint32_t str_len(const char *s) {
+    return s != NULL ? strlen(s) + 1 : 0;
+}
+
+// Records a note which has closed.  Returns whether it was kept: a note too
+// big for the whole buffer isn't.
+extern int history_record(const NLNote *n, int64_t opened, enum CloseReason reason) {
+    entry e;
+    int kept = 0;
+    e.id      = n->id;
+    e.reason  = reason;
+    e.opened  = opened;
+    e.closed  = g_get_real_time();
+#if NL_URGENCY
+    e.urgency = n->urgency;
+#else
+    e.urgency = -1;
+#endif
+    e.applen  = str_len(n->appname);
+    e.sumlen  = str_len(n->summary);
+    e.bodylen = str_len(n->body);
+
+    size_t size = entry_size(&e);
+
+    pthread_mutex_lock(&history_lock);
+    if (size > cap)
+        goto out;
+
+    if (tail + size > cap) {
+        // Entries between here and the end are the oldest there are; let
+        // them go rather than split this one.
+        while (!g_queue_is_empty(&live)
+                && GPOINTER_TO_UINT(g_queue_peek_head(&live)) >= tail)
+            evict_oldest();
+        tail = 0;
+    }
+    while (!g_queue_is_empty(&live)
+            && overlaps(GPOINTER_TO_UINT(g_queue_peek_head(&live)), tail, size))
+        evict_oldest();
+
+    char *p = buf + tail;
+    memcpy(p, &e, sizeof(entry));
+    p += sizeof(entry);
+    put_str(&p, n->appname, e.applen);
+    put_str(&p, n->summary, e.sumlen);
+    put_str(&p, n->body, e.bodylen);
+
+    g_queue_push_tail(&live, GUINT_TO_POINTER(tail));
+    g_hash_table_replace(by_id, GUINT_TO_POINTER(e.id), GUINT_TO_POINTER(tail + 1));
+    tail += size;
+    kept = 1;
+
+out:
+    pthread_mutex_unlock(&history_lock);
+    return kept;
+}
+
+static void unpack(size_t off, NLHistoryEntry *out) {
+    const entry *e = entry_at(off);
+    const char *p = (const char *)(e + 1);
+
+    out->id      = e->id;
+    out->reason  = e->reason;
+    out->opened  = e->opened;
+    out->closed  = e->closed;
+    out->urgency = e->urgency;
+
+    out->appname = e->applen ? p : NULL;
+    p += e->applen;
+    out->summary = e->sumlen ? p : NULL;
+    p += e->sumlen;
+    out->body    = e->bodylen ? p : NULL;
+}
+
+extern int nl_history_lookup(unsigned int id, NLHistoryEntry *out) {
+    int found = 0;
+
+    pthread_mutex_lock(&history_lock);
+    if (by_id != NULL) {
+        size_t off = GPOINTER_TO_UINT(g_hash_table_lookup(by_id, GUINT_TO_POINTER(id)));
+        if (off != 0) {
+            unpack(off - 1, out);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    return found;
+}
+
+extern size_t nl_history_foreach(void (*fn)(const NLHistoryEntry *, void *), void *data) {
+    NLHistoryEntry h;
+    GList *l;
+    size_t count = 0;
+
+    pthread_mutex_lock(&history_lock);
+    for (l = live.head; l != NULL; l = l->next) {
+        unpack(GPOINTER_TO_UINT(l->data), &h);
+        fn(&h, data);
+        count++;
+    }
+    pthread_mutex_unlock(&history_lock);
+
+    return count;
+}
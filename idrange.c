@@ -106,3 +106,47 @@ extern uint32_t get_unclaimed_id(void) {
     claim_id(ret);
     return ret;
 }
+
+// Claims every ID from min to max, inclusive, at once.
+extern void claim_range(uint32_t min, uint32_t max) {
+    if (min == 0)
+        min = 1;
+    if (min > max)
+        return;
+
+    // Skip the ranges which end well before this one starts.
+    range **link = &r;
+    while (*link != NULL && (*link)->max != MAX && (*link)->max + 1 < min)
+        link = &(*link)->next;
+
+    range *cr = *link;
+    if (cr == NULL || (max != MAX && cr->min > max + 1)) {
+        range *nr = ealloc(sizeof(range));
+        nr->min = min;
+        nr->max = max;
+        nr->next = cr;
+        *link = nr;
+        return;
+    }
+
+    // Otherwise, this range touches cr; grow cr, and swallow any ranges it
+    // now touches too.
+    if (min < cr->min)
+        cr->min = min;
+    if (max > cr->max)
+        cr->max = max;
+    while (cr->next != NULL && (cr->max == MAX || cr->next->min <= cr->max + 1)) {
+        range *vr = cr->next;
+        if (vr->max > cr->max)
+            cr->max = vr->max;
+        cr->next = vr->next;
+        free(vr);
+    }
+}
+
+// Adds each claimed range to the given a(uu) builder.
+extern void idrange_snapshot(GVariantBuilder *b) {
+    range *cr;
+    for (cr = r; cr != NULL; cr = cr->next)
+        g_variant_builder_add(b, "(uu)", cr->min, cr->max);
+}
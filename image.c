@@ -0,0 +1,209 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Raw image hints ("image-data", and the deprecated "image_data" and
+ * "icon_data") are often the same avatar or album art sent over and over.
+ * Rather than keep a copy of the pixels in every note, this file decodes them
+ * into refcounted NLImages which are shared between all notes with identical
+ * image content.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#if NL_IMAGES
+
+// In order of precedence, per the spec.
+static const char *image_hints[] = {
+    "image-data",
+    "image_data",
+    "icon_data",
+    NULL
+};
+
+struct image {
+    NLImage img;    /* must be first; we hand out pointers to this */
+    guint hash;
+    int refs;
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *cache = NULL;
+
+// FNV-1a, eight bytes at a time.  This only has to be good enough to keep
+// the hash table's buckets short; equality is always checked in full.
+static guint hash_pixels(const unsigned char *data, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t w;
+    size_t i;
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+    }
+    for (; i < len; i++)
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    return (guint)(h ^ (h >> 32));
+}
+
+static guint image_hash(gconstpointer p) {
+    return ((const struct image *)p)->hash;
+}
+
+static gboolean image_equal(gconstpointer pa, gconstpointer pb) {
+    const NLImage *a = &((const struct image *)pa)->img;
+    const NLImage *b = &((const struct image *)pb)->img;
+
+    return a->width == b->width
+        && a->height == b->height
+        && a->rowstride == b->rowstride
+        && a->has_alpha == b->has_alpha
+        && a->bits_per_sample == b->bits_per_sample
+        && a->channels == b->channels
+        && a->len == b->len
+        && memcmp(a->data, b->data, a->len) == 0;
+}
+
+// Returns whether the buffer is big enough for the claimed dimensions.
+static int image_valid(const NLImage *i) {
+    if (i->width <= 0 || i->height <= 0 || i->rowstride <= 0)
+        return 0;
+    if (i->channels <= 0 || i->bits_per_sample <= 0)
+        return 0;
+
+    uint64_t row  = ((uint64_t)i->width * i->channels * i->bits_per_sample + 7) / 8;
+    uint64_t need = (uint64_t)i->rowstride * (i->height - 1) + row;
+    return row <= (uint64_t)i->rowstride && need <= i->len;
+}
+
+// Looks up the given image in the cache, or copies it in if it is not there.
+// Either way, returns a new reference.
+static NLImage *intern_image(const NLImage *key) {
+    struct image k = { .img = *key };
+    k.hash = hash_pixels(key->data, key->len);
+
+    struct image *im;
+    pthread_mutex_lock(&cache_lock);
+    if (cache == NULL)
+        cache = g_hash_table_new(image_hash, image_equal);
+
+    im = g_hash_table_lookup(cache, &k);
+    if (im != NULL) {
+        im->refs++;
+    } else {
+        im = ealloc(sizeof(struct image));
+        *im = k;
+        im->refs = 1;
+
+        unsigned char *data = ealloc(key->len ? key->len : 1);
+        memcpy(data, key->data, key->len);
+        im->img.data = data;
+
+        g_hash_table_add(cache, im);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return &im->img;
+}
+
+static NLImage *decode_image(GVariant *v) {
+    NLImage key;
+    GVariant *pixels;
+
+    g_variant_get(v, "(iiibii@ay)",
+                  &key.width, &key.height, &key.rowstride,
+                  &key.has_alpha, &key.bits_per_sample, &key.channels,
+                  &pixels);
+
+    gsize len;
+    key.data = g_variant_get_fixed_array(pixels, &len, sizeof(unsigned char));
+    key.len = len;
+
+    NLImage *img = NULL;
+    if (image_valid(&key))
+        img = intern_image(&key);
+
+    g_variant_unref(pixels);
+    return img;
+}
+
+// Decodes the highest-precedence raw image hint, if there is a valid one that
+// is within the limit.  On success, all of the raw image hints are removed
+// from the note's hints so that their pixels are not kept around twice.  They
+// are also removed if any was over the limit, so its pixels aren't kept.
+extern NLImage *image_from_hints(NLHints *hints) {
+    NLImage *img = NULL;
+    int oversized = 0;
+    int i;
+
+    for (i = 0; img == NULL && image_hints[i] != NULL; i++) {
+        GVariant *v = hints_lookup(hints, image_hints[i],
+                G_VARIANT_TYPE("(iiibiiay)"));
+        if (v == NULL)
+            continue;
+        if (limit_image(v))
+            img = decode_image(v);
+        else
+            oversized = 1;
+    }
+
+    if (img != NULL || oversized) {
+        for (i = 0; image_hints[i] != NULL; i++)
+            hints_remove(hints, image_hints[i]);
+    }
+    return img;
+}
+
+extern const NLImage *nl_get_image(const NLNote *n) {
+    if (n == NULL)
+        return NULL;
+    return n->image;
+}
+
+extern NLImage *nl_image_ref(const NLImage *img) {
+    struct image *im = (struct image *)img;
+
+    pthread_mutex_lock(&cache_lock);
+    im->refs++;
+    pthread_mutex_unlock(&cache_lock);
+
+    return &im->img;
+}
+
+extern void nl_image_unref(NLImage *img) {
+    if (img == NULL)
+        return;
+
+    struct image *im = (struct image *)img;
+    int dead;
+
+    pthread_mutex_lock(&cache_lock);
+    dead = (--im->refs == 0);
+    if (dead)
+        g_hash_table_remove(cache, im);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (dead) {
+        free((void *)im->img.data);
+        free(im);
+    }
+}
+
+#endif
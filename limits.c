@@ -0,0 +1,131 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Limits on the size of each part of a notification, applied as Notify calls
+ * are decoded.  Strings over their limit are cut short, at a character
+ * boundary, before they are copied out of the message; actions and hints past
+ * their limit, and images over theirs, are never copied at all.
+ *
+ * The limits are set before notlib_run and only read afterwards.  The limit_*
+ * functions run wherever notes are built: on the D-Bus thread, or on the
+ * decode threads (see nl_set_decode_threads).  The counters are bumped from
+ * all of them, and read by nl_get_limit_counters from any thread, so they're
+ * kept atomically.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+static NLLimits limits = { 0 };
+static NLLimitCounters counters = { 0 };
+
+extern void nl_set_limits(const NLLimits *l) {
+    static const NLLimits none = { 0 };
+    limits = l != NULL ? *l : none;
+}
+
+static void count(unsigned long *c, unsigned long n) {
+    __atomic_fetch_add(c, n, __ATOMIC_RELAXED);
+}
+
+static unsigned long load(const unsigned long *c) {
+    return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+extern void nl_get_limit_counters(NLLimitCounters *out) {
+    out->summaries_truncated = load(&counters.summaries_truncated);
+    out->bodies_truncated    = load(&counters.bodies_truncated);
+    out->bytes_truncated     = load(&counters.bytes_truncated);
+    out->hints_dropped       = load(&counters.hints_dropped);
+#if NL_ACTIONS
+    out->actions_dropped     = load(&counters.actions_dropped);
+#endif
+#if NL_IMAGES
+    out->images_dropped      = load(&counters.images_dropped);
+#endif
+}
+
+// Copies a string, cut short to at most max bytes (0 meaning no limit).  The
+// cut backs up past any continuation bytes, so it never splits a character.
+static char *dup_limited(GVariant *v, size_t max, unsigned long *truncated) {
+    gsize len;
+    const char *s = g_variant_get_string(v, &len);
+
+    if (max == 0 || len <= max)
+        return g_strndup(s, len);
+
+    size_t cut = max;
+    while (cut > 0 && ((unsigned char)s[cut] & 0xc0) == 0x80)
+        cut--;
+
+    count(truncated, 1);
+    count(&counters.bytes_truncated, len - cut);
+    return g_strndup(s, cut);
+}
+
+extern char *limit_summary(GVariant *v) {
+    return dup_limited(v, limits.summary_bytes, &counters.summaries_truncated);
+}
+
+extern char *limit_body(GVariant *v) {
+    return dup_limited(v, limits.body_bytes, &counters.bodies_truncated);
+}
+
+// Returns how many of a dict's n hints to keep, counting the rest as dropped.
+extern size_t limit_hints(size_t n) {
+    if (limits.hints == 0 || n <= limits.hints)
+        return n;
+    count(&counters.hints_dropped, n - limits.hints);
+    return limits.hints;
+}
+
+#if NL_ACTIONS
+// Copies the first actions from an "as", up to the limit; the count of
+// strings copied is written to *count.
+extern char **limit_actions(GVariant *v, size_t *count_out) {
+    size_t n = g_variant_n_children(v);
+    size_t keep = n;
+    size_t i;
+
+    if (limits.actions != 0 && n / 2 > limits.actions) {
+        keep = 2 * limits.actions;
+        count(&counters.actions_dropped, n / 2 - limits.actions);
+    }
+
+    char **strv = g_new(char *, keep + 1);
+    for (i = 0; i < keep; i++)
+        g_variant_get_child(v, i, "s", &strv[i]);
+    strv[keep] = NULL;
+
+    *count_out = keep;
+    return strv;
+}
+#endif
+
+#if NL_IMAGES
+// Returns false, counting it as dropped, if an image hint is over the limit.
+extern int limit_image(GVariant *v) {
+    if (limits.image_bytes == 0 || g_variant_get_size(v) <= limits.image_bytes)
+        return 1;
+    count(&counters.images_dropped, 1);
+    return 0;
+}
+#endif
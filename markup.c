@@ -0,0 +1,339 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Parsing of the body markup the notification spec allows: <b>, <i>, <u>,
+ * <a href="...">, <img src="..." alt="..."/>, and XML entities.  Each body
+ * is parsed once, when its note is decoded, into plain text and a run of
+ * spans covering it, so that renderers need only walk an array.
+ *
+ * Clients are not known for sending well-formed markup, so parsing never
+ * fails: unknown tags are dropped, unmatched closing tags are ignored, and a
+ * '<' or '&' which doesn't begin a tag or entity is kept as text.  The text
+ * and spans live in a single allocation.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#if NL_MARKUP
+
+typedef struct {
+    GString *text;
+    GString *strings;   /* attribute values, NUL-separated */
+    GArray *spans;      /* of NLSpan, with string offsets in place of pointers */
+
+    int bold, italic, underline;
+    GArray *links;      /* stack of href offsets into strings */
+
+    size_t start;       /* where the current span began */
+    unsigned style;
+    size_t href;
+} parser;
+
+/* Span string fields hold offset + 1 into parser.strings until the end, so
+ * that 0 can stand for NULL. */
+#define NO_STRING 0
+
+static unsigned current_style(const parser *p) {
+    unsigned style = 0;
+    if (p->bold)      style |= SPAN_BOLD;
+    if (p->italic)    style |= SPAN_ITALIC;
+    if (p->underline) style |= SPAN_UNDERLINE;
+    if (p->links->len > 0) style |= SPAN_LINK;
+    return style;
+}
+
+static size_t current_href(const parser *p) {
+    if (p->links->len == 0)
+        return NO_STRING;
+    return g_array_index(p->links, size_t, p->links->len - 1);
+}
+
+static void push_span(parser *p, size_t start, unsigned style,
+                      size_t href, size_t alt) {
+    NLSpan s;
+    s.start = start;
+    s.len   = p->text->len - start;
+    s.style = style;
+    s.href  = (const char *)(uintptr_t)href;
+    s.alt   = (const char *)(uintptr_t)alt;
+    g_array_append_val(p->spans, s);
+}
+
+// Ends the current span, if it has any text, and starts a new one with the
+// current style.
+static void restyle(parser *p) {
+    unsigned style = current_style(p);
+    size_t href = current_href(p);
+    if (style == p->style && href == p->href)
+        return;
+
+    if (p->text->len > p->start)
+        push_span(p, p->start, p->style, p->href, NO_STRING);
+    p->start = p->text->len;
+    p->style = style;
+    p->href  = href;
+}
+
+// Decodes the entity at *s, if there is one, onto out, and moves *s past it.
+static int decode_entity(const char **s, GString *out) {
+    static const struct { const char *name; char c; } named[] = {
+        { "amp;", '&' }, { "lt;", '<' }, { "gt;", '>' },
+        { "quot;", '"' }, { "apos;", '\'' }, { NULL, 0 }
+    };
+    const char *e = *s + 1;
+    int i;
+
+    if (*e == '#') {
+        char *end;
+        unsigned long c;
+        if (e[1] == 'x' || e[1] == 'X')
+            c = strtoul(e + 2, &end, 16);
+        else
+            c = strtoul(e + 1, &end, 10);
+        if (*end != ';' || end == e + 1 || c == 0 || c > 0x10FFFF
+                || !g_unichar_validate(c))
+            return 0;
+        g_string_append_unichar(out, c);
+        *s = end + 1;
+        return 1;
+    }
+
+    for (i = 0; named[i].name != NULL; i++) {
+        size_t len = strlen(named[i].name);
+        if (strncmp(e, named[i].name, len) == 0) {
+            g_string_append_c(out, named[i].c);
+            *s = e + len;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void append_decoded(GString *out, const char *s, size_t len) {
+    const char *end = s + len;
+    while (s < end) {
+        if (*s == '&' && decode_entity(&s, out))
+            continue;
+        g_string_append_c(out, *s++);
+    }
+}
+
+// Finds the value of the given attribute between s and end, and copies it,
+// decoded, into the parser's strings.  Returns its offset + 1, or NO_STRING.
+static size_t find_attr(parser *p, const char *s, const char *end,
+                        const char *name) {
+    size_t nlen = strlen(name);
+
+    while (s < end) {
+        while (s < end && g_ascii_isspace(*s))
+            s++;
+        const char *key = s;
+        while (s < end && *s != '=' && !g_ascii_isspace(*s))
+            s++;
+        size_t klen = s - key;
+        while (s < end && g_ascii_isspace(*s))
+            s++;
+        if (s >= end || *s != '=') {
+            if (s == key)
+                s++;
+            continue;
+        }
+        s++;
+        while (s < end && g_ascii_isspace(*s))
+            s++;
+
+        const char *val = s;
+        if (s < end && (*s == '"' || *s == '\'')) {
+            char q = *s++;
+            val = s;
+            while (s < end && *s != q)
+                s++;
+        } else {
+            while (s < end && !g_ascii_isspace(*s))
+                s++;
+        }
+        size_t vlen = s - val;
+        if (s < end && (*s == '"' || *s == '\''))
+            s++;
+
+        if (klen == nlen && g_ascii_strncasecmp(key, name, nlen) == 0) {
+            size_t off = p->strings->len;
+            append_decoded(p->strings, val, vlen);
+            g_string_append_c(p->strings, '\0');
+            return off + 1;
+        }
+    }
+    return NO_STRING;
+}
+
+// Whether s points to the start of something that looks like a tag, given
+// the first '>' after it (NULL if there's none).
+static int starts_tag(const char *s, const char *gt) {
+    if (s[1] == '/')
+        s++;
+    return g_ascii_isalpha(s[1]) && gt != NULL;
+}
+
+static int tag_is(const char *name, size_t len, const char *want) {
+    return len == strlen(want) && g_ascii_strncasecmp(name, want, len) == 0;
+}
+
+static void count(int *depth, int closing) {
+    if (closing) {
+        if (*depth > 0)
+            (*depth)--;
+    } else {
+        (*depth)++;
+    }
+}
+
+// Handles the tag between s and end, exclusive of its angle brackets.
+static void handle_tag(parser *p, const char *s, const char *end) {
+    int closing = 0;
+    if (s < end && *s == '/') {
+        closing = 1;
+        s++;
+    }
+    if (end > s && end[-1] == '/')
+        end--;
+
+    const char *name = s;
+    while (s < end && g_ascii_isalnum(*s))
+        s++;
+    size_t len = s - name;
+
+    if (tag_is(name, len, "b")) {
+        count(&p->bold, closing);
+    } else if (tag_is(name, len, "i")) {
+        count(&p->italic, closing);
+    } else if (tag_is(name, len, "u")) {
+        count(&p->underline, closing);
+    } else if (tag_is(name, len, "a")) {
+        if (closing) {
+            if (p->links->len > 0)
+                g_array_set_size(p->links, p->links->len - 1);
+        } else {
+            size_t href = find_attr(p, s, end, "href");
+            g_array_append_val(p->links, href);
+        }
+    } else if (tag_is(name, len, "img") && !closing) {
+        // An image gets a span of its own, holding its alt text.
+        size_t src = find_attr(p, s, end, "src");
+        size_t alt = find_attr(p, s, end, "alt");
+
+        restyle(p);
+        if (p->text->len > p->start)
+            push_span(p, p->start, p->style, p->href, NO_STRING);
+
+        size_t start = p->text->len;
+        if (alt != NO_STRING)
+            g_string_append(p->text, p->strings->str + alt - 1);
+        push_span(p, start, p->style | SPAN_IMAGE, src, alt);
+        p->start = p->text->len;
+        return;
+    }
+
+    restyle(p);
+}
+
+static const char *resolve(const char *strings, const char *off) {
+    uintptr_t o = (uintptr_t)off;
+    return o == NO_STRING ? NULL : strings + o - 1;
+}
+
+// Parses the given body.  A body with no markup at all still gets a (single)
+// span, so that renderers have only the one case to handle.
+extern NLMarkup *markup_parse(const char *body) {
+    if (body == NULL)
+        return NULL;
+
+    parser p;
+    p.text    = g_string_sized_new(strlen(body));
+    p.strings = g_string_new(NULL);
+    p.spans   = g_array_new(FALSE, FALSE, sizeof(NLSpan));
+    p.links   = g_array_new(FALSE, FALSE, sizeof(size_t));
+    p.bold = p.italic = p.underline = 0;
+    p.start = 0;
+    p.style = 0;
+    p.href  = NO_STRING;
+
+    // The first '>' at or after s, only looked for again once s has passed
+    // it, so that a body full of stray '<'s isn't rescanned for each one.
+    const char *s = body;
+    const char *gt = strchr(body, '>');
+    while (*s) {
+        if (*s == '<') {
+            if (gt != NULL && gt < s)
+                gt = strchr(s, '>');
+            if (starts_tag(s, gt)) {
+                handle_tag(&p, s + 1, gt);
+                s = gt + 1;
+                continue;
+            }
+        }
+        if (*s == '&' && decode_entity(&s, p.text))
+            continue;
+        g_string_append_c(p.text, *s++);
+    }
+    if (p.text->len > p.start)
+        push_span(&p, p.start, p.style, p.href, NO_STRING);
+
+    // Pack it all into one allocation: the header, the spans, the text, then
+    // the attribute strings.
+    size_t spans_size = sizeof(NLSpan) * p.spans->len;
+    size_t size = sizeof(NLMarkup) + spans_size + p.text->len + 1 + p.strings->len;
+    NLMarkup *m = ealloc(size);
+    NLSpan *spans = (NLSpan *)(m + 1);
+    char *text = (char *)spans + spans_size;
+    char *strings = text + p.text->len + 1;
+
+    memcpy(text, p.text->str, p.text->len + 1);
+    if (p.strings->len > 0)
+        memcpy(strings, p.strings->str, p.strings->len);
+
+    size_t i;
+    for (i = 0; i < p.spans->len; i++) {
+        spans[i] = g_array_index(p.spans, NLSpan, i);
+        spans[i].href = resolve(strings, spans[i].href);
+        spans[i].alt  = resolve(strings, spans[i].alt);
+    }
+
+    m->text   = text;
+    m->len    = p.text->len;
+    m->spans  = spans;
+    m->nspans = p.spans->len;
+
+    g_string_free(p.text, TRUE);
+    g_string_free(p.strings, TRUE);
+    g_array_free(p.spans, TRUE);
+    g_array_free(p.links, TRUE);
+    return m;
+}
+
+extern const NLMarkup *nl_get_markup(const NLNote *n) {
+    if (n == NULL)
+        return NULL;
+    return n->markup;
+}
+
+#endif
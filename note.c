@@ -17,25 +17,152 @@
  * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <limits.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "notlib.h"
 #include "_notlib_internal.h"
 
-extern NLNote *new_note(uint32_t id, char *appname,
+#if NL_STD_HINTS
+#define GET_STRING(v)  g_variant_get_string(v, NULL)
+#define GET_BOOLEAN(v) g_variant_get_boolean(v)
+#define GET_INT32(v)   g_variant_get_int32(v)
+
+// Each standard hint needs a bit in the presence mask.
+G_STATIC_ASSERT(STD_HINT_COUNT <= sizeof(((NLStdHints *)0)->present) * CHAR_BIT);
+
+// The standard hints' keys, interned along with the other known keys (see
+// new_hints), so that they're filed by quark from the very first note.
+static GQuark std_quarks[STD_HINT_COUNT];
+
+// Decodes the standard hints once, so that reading them is a field load.
+static void decode_std_hints(NLStdHints *std, const NLHints *h) {
+    GVariant *v;
+
+    memset(std, 0, sizeof(*std));
+    if (h == NULL)
+        return;
+
+#define DECODE(NAME, field, key, type, ctype) \
+    v = g_hash_table_lookup(h->table, GUINT_TO_POINTER(std_quarks[STD_HINT_##NAME])); \
+    if (v != NULL && g_variant_is_of_type(v, G_VARIANT_TYPE_##type)) { \
+        std->field = GET_##type(v); \
+        std->present |= 1u << STD_HINT_##NAME; \
+    }
+    NL_STD_HINT_TABLE(DECODE)
+#undef DECODE
+}
+#endif
+
+/*
+ * App names are interned, so that notes from the same app share one copy and
+ * can be compared by pointer.  Unlike with g_intern_string, each string is
+ * refcounted and freed once nothing holds it, so clients can't grow the table
+ * without bound by making names up.  Notes are built on any thread, so the
+ * table is locked.
+ */
+
+typedef struct {
+    size_t refs;
+    char s[];
+} interned;
+
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *interns = NULL;  /* string -> interned */
+
+// Returns the interned copy of s, taking a reference to it.
+extern const char *intern_ref(const char *s) {
+    interned *e;
+
+    pthread_mutex_lock(&intern_lock);
+    if (interns == NULL)
+        interns = g_hash_table_new(g_str_hash, g_str_equal);
+
+    e = g_hash_table_lookup(interns, s);
+    if (e == NULL) {
+        size_t len = strlen(s) + 1;
+        e = ealloc(sizeof(interned) + len);
+        e->refs = 0;
+        memcpy(e->s, s, len);
+        g_hash_table_insert(interns, e->s, e);
+    }
+    e->refs++;
+    pthread_mutex_unlock(&intern_lock);
+
+    return e->s;
+}
+
+// Returns the interned copy of s, if there is one, without taking a reference.
+extern const char *intern_find(const char *s) {
+    interned *e = NULL;
+
+    pthread_mutex_lock(&intern_lock);
+    if (interns != NULL)
+        e = g_hash_table_lookup(interns, s);
+    pthread_mutex_unlock(&intern_lock);
+
+    return e != NULL ? e->s : NULL;
+}
+
+// Drops a reference taken by intern_ref.  s must be the interned copy.
+extern void intern_unref(const char *s) {
+    if (s == NULL)
+        return;
+
+    interned *e = (interned *)(s - offsetof(interned, s));
+
+    pthread_mutex_lock(&intern_lock);
+    if (--e->refs == 0) {
+        g_hash_table_remove(interns, e->s);
+        free(e);
+    }
+    pthread_mutex_unlock(&intern_lock);
+}
+
+/* A note, with what notlib keeps about it that servers needn't see. */
+typedef struct {
+    NLNote pub;
+    int shared;     /* other clients have been given its ID, as a duplicate */
+} note;
+
+// Marks a note as having been handed to a client other than its sender, so
+// that its signals are broadcast rather than sent only to the sender.  May be
+// called from any thread.
+extern void note_share(const NLNote *n) {
+    __atomic_store_n(&((note *)n)->shared, 1, __ATOMIC_RELAXED);
+}
+
+// Returns the name a note's signals are to be sent to, or NULL to broadcast.
+extern const char *note_dest(const NLNote *n) {
+    if (__atomic_load_n(&((const note *)n)->shared, __ATOMIC_RELAXED))
+        return NULL;
+    return n->sender;
+}
+
+// Takes ownership of a reference to the (interned) app name.
+extern NLNote *new_note(uint32_t id, const char *appname,
                         char *summary, char *body,
 #if NL_ACTIONS
                         NLActions *actions,
 #endif
 #if NL_URGENCY
                         enum NLUrgency urgency,
+#endif
+#if NL_IMAGES
+                        NLImage *image,
 #endif
                         NLHints *hints,
                         int32_t timeout) {
-    NLNote *n = ealloc(sizeof(NLNote));
+    note *priv = ealloc(sizeof(note));
+    NLNote *n = &priv->pub;
 
+    priv->shared = 0;
     n->id      = id;
     n->appname = appname;
+    n->sender  = NULL;
     n->summary = summary;
     n->body    = body;
     n->timeout = timeout;
@@ -44,24 +171,140 @@ extern NLNote *new_note(uint32_t id, char *appname,
 #endif
 #if NL_URGENCY
     n->urgency = urgency;
+#endif
+#if NL_IMAGES
+    n->image = image;
+#endif
+#if NL_MARKUP
+    n->markup = markup_parse(body);
+#endif
+#if NL_STD_HINTS
+    decode_std_hints(&n->std, hints);
 #endif
     n->hints = hints;
     return n;
 }
 
-extern int nl_get_hint(const NLNote *n, const char *key, NLHint *out) {
+/*
+ * Hints with well-known keys are kept in a table keyed by GQuark, so every
+ * note shares one copy of each key, and lookups compare keys by pointer.
+ * Quarks are never freed, so only a fixed set of keys is ever made into one;
+ * any other key is copied into a second table, owned by the note.  Looking a
+ * key up never interns it.
+ */
+
+static const char *known_hints[] = {
+    "action-icons", "category", "desktop-entry", "image-path", "image_path",
+    "resident", "sound-file", "sound-name", "suppress-sound", "transient",
+    "urgency", "value", "x", "y",
+    "image-data", "image_data", "icon_data",
+    "synchronous", "private-synchronous", "x-canonical-private-synchronous",
+    "x-dunst-stack-tag",
+    NULL
+};
+
+static void intern_known_hints(void) {
+    static gsize interned_keys = 0;
+    int i;
+
+    if (g_once_init_enter(&interned_keys)) {
+        for (i = 0; known_hints[i] != NULL; i++)
+            g_quark_from_static_string(known_hints[i]);
+#if NL_STD_HINTS
+        // A custom table may add keys of its own.
+#define INTERN(NAME, field, key, type, ctype) \
+        std_quarks[STD_HINT_##NAME] = g_quark_from_static_string(key);
+        NL_STD_HINT_TABLE(INTERN)
+#undef INTERN
+#endif
+        g_once_init_leave(&interned_keys, 1);
+    }
+}
+
+// Takes the hints from an a{sv}, up to the limit on hints.
+extern NLHints *new_hints(GVariant *dict) {
+    NLHints *h = ealloc(sizeof(NLHints));
+    size_t keep = limit_hints(g_variant_n_children(dict));
+    h->table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                     NULL, (GDestroyNotify)g_variant_unref);
+    h->other = NULL;
+    h->size = 0;
+
+    intern_known_hints();
+
+    GVariantIter iter;
+    const char *key;
+    GVariant *value;
+    g_variant_iter_init(&iter, dict);
+    while (keep-- > 0 && g_variant_iter_next(&iter, "{&sv}", &key, &value)) {
+        GQuark q = g_quark_try_string(key);
+        h->size += variant_size(value);
+        if (q != 0) {
+            g_hash_table_replace(h->table, GUINT_TO_POINTER(q), value);
+            continue;
+        }
+
+        if (h->other == NULL)
+            h->other = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                             (GDestroyNotify)g_variant_unref);
+        h->size += strlen(key) + 1;
+        g_hash_table_replace(h->other, g_strdup(key), value);
+    }
+    return h;
+}
+
+// Returns a borrowed reference to the hint with the given key, if it exists
+// and (if type is non-NULL) has the given type.
+extern GVariant *hints_lookup(const NLHints *h, const char *key,
+                              const GVariantType *type) {
+    if (h == NULL)
+        return NULL;
+
+    GQuark q = g_quark_try_string(key);
+    GVariant *v = NULL;
+
+    if (q != 0)
+        v = g_hash_table_lookup(h->table, GUINT_TO_POINTER(q));
+    if (v == NULL && h->other != NULL)
+        v = g_hash_table_lookup(h->other, key);
+    if (v == NULL || (type != NULL && !g_variant_is_of_type(v, type)))
+        return NULL;
+    return v;
+}
+
+extern void hints_remove(NLHints *h, const char *key) {
+    if (h == NULL)
+        return;
+    GQuark q = g_quark_try_string(key);
+    if (q != 0)
+        g_hash_table_remove(h->table, GUINT_TO_POINTER(q));
+    if (h->other != NULL)
+        g_hash_table_remove(h->other, key);
+}
+
+extern void free_hints(NLHints *h) {
+    if (!h) return;
+    g_hash_table_unref(h->table);
+    if (h->other != NULL)
+        g_hash_table_unref(h->other);
+    free(h);
+}
+
+static GVariant *lookup(const NLNote *n, const char *key, const GVariantType *type) {
     if (n == NULL)
-        return 0;
+        return NULL;
+    return hints_lookup(n->hints, key, type);
+}
 
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict, key, NULL);
+extern int nl_get_hint(const NLNote *n, const char *key, NLHint *out) {
+    GVariant *gv = lookup(n, key, NULL);
     if (gv == NULL) return 0;
 
     const GVariantType *t = g_variant_get_type(gv);
 
     if (g_variant_type_equal(t, G_VARIANT_TYPE_STRING)) {
         out->type = HINT_TYPE_STRING;
-        size_t len;
-        out->d.str = g_variant_get_string(gv, &len);
+        out->d.str = g_variant_get_string(gv, NULL);
     } else if (g_variant_type_equal(t, G_VARIANT_TYPE_BOOLEAN)) {
         out->type = HINT_TYPE_BOOLEAN;
         out->d.bl = g_variant_get_boolean(gv);
@@ -72,32 +315,20 @@ extern int nl_get_hint(const NLNote *n, const char *key, NLHint *out) {
         out->type = HINT_TYPE_INT;
         out->d.i = g_variant_get_int32(gv);
     } else {
-        g_variant_unref(gv);
         return 0;
     }
 
-    g_variant_unref(gv);
     return 1;
 }
 
 extern char *nl_get_hint_as_string(const NLNote *n, const char *key) {
-    char *out;
-    if (n == NULL)
+    GVariant *gv = lookup(n, key, NULL);
+    if (gv == NULL)
         return NULL;
 
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict,
-            key, G_VARIANT_TYPE_STRING);
-
-    if (gv != NULL) {
-        out = g_variant_dup_string(gv, NULL);
-    } else {
-        gv = g_variant_dict_lookup_value(n->hints->dict, key, NULL);
-        if (gv == NULL) return NULL;
-        out = g_variant_print(gv, FALSE);
-    }
-
-    g_variant_unref(gv);
-    return out;
+    if (g_variant_is_of_type(gv, G_VARIANT_TYPE_STRING))
+        return g_variant_dup_string(gv, NULL);
+    return g_variant_print(gv, FALSE);
 }
 
 extern enum NLHintType nl_get_hint_type(const NLNote *n, const char *key) {
@@ -108,53 +339,34 @@ extern enum NLHintType nl_get_hint_type(const NLNote *n, const char *key) {
 }
 
 extern int nl_get_int_hint(const NLNote *n, const char *key, int *out) {
-    if (n == NULL)
-        return 0;
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict,
-            key, G_VARIANT_TYPE_INT32);
+    GVariant *gv = lookup(n, key, G_VARIANT_TYPE_INT32);
     if (gv == NULL)
         return 0;
     *out = g_variant_get_int32(gv);
-    g_variant_unref(gv);
     return 1;
 }
 
 extern int nl_get_byte_hint(const NLNote *n, const char *key, unsigned char *out) {
-    if (n == NULL)
-        return 0;
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict,
-            key, G_VARIANT_TYPE_BYTE);
+    GVariant *gv = lookup(n, key, G_VARIANT_TYPE_BYTE);
     if (gv == NULL)
         return 0;
     *out = g_variant_get_byte(gv);
-    g_variant_unref(gv);
     return 1;
 }
 
 extern int nl_get_boolean_hint(const NLNote *n, const char *key, int *out) {
-    if (n == NULL)
-        return 0;
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict,
-                key, G_VARIANT_TYPE_BOOLEAN);
-    if (gv == NULL) {
+    GVariant *gv = lookup(n, key, G_VARIANT_TYPE_BOOLEAN);
+    if (gv == NULL)
         return 0;
-    }
     *out = g_variant_get_boolean(gv);
-    g_variant_unref(gv);
     return 1;
 }
 
 extern int nl_get_string_hint(const NLNote *n, const char *key, const char **out) {
-    if (n == NULL)
-        return 0;
-
-    size_t l;
-    GVariant *gv = g_variant_dict_lookup_value(n->hints->dict,
-            key, G_VARIANT_TYPE_STRING);
+    GVariant *gv = lookup(n, key, G_VARIANT_TYPE_STRING);
     if (gv == NULL)
         return 0;
-    *out = g_variant_get_string(gv, &l);
-    g_variant_unref(gv);
+    *out = g_variant_get_string(gv, NULL);
     return 1;
 }
 
@@ -167,11 +379,16 @@ static int invoke_action(const NLNote *n, void *v) {
     if (strcmp(key, "default") && !nl_action_name(n, key))
         return 0;
 
-    signal_action_invoked(n->id, key);
+    signal_action_invoked(n->id, note_dest(n), key);
 
+#if NL_STD_HINTS
+    if (nl_has_std_hint(n, STD_HINT_RESIDENT) && n->std.resident)
+        goto ret;
+#else
     int resident;
     if (nl_get_boolean_hint(n, "resident", &resident) && resident)
         goto ret;
+#endif
 
     nl_close_note(n->id);
 ret:
@@ -182,25 +399,41 @@ extern int nl_invoke_action(unsigned int id, const char *key) {
     return queue_call(id, invoke_action, (void *)key);
 }
 
-static void init_keys_names(NLActions *a) {
-    char **keys  = ealloc(sizeof(char *) * (a->count / 2));
-    char **names = ealloc(sizeof(char *) * (a->count / 2));
+// Takes ownership of the given action strings, which alternate key, name,
+// key, name...  Returns NULL if there are no actions at all.
+extern NLActions *new_actions(char **actions, size_t count) {
+    if (count < 1) {
+        g_strfreev(actions);
+        return NULL;
+    }
+
+    NLActions *a = ealloc(sizeof(NLActions));
+    size_t nkeys = count / 2;
+
+    a->actions = actions;
+    a->count   = count;
+    a->keys    = ealloc(sizeof(char *) * (nkeys + 1));
+    a->names   = ealloc(sizeof(char *) * (nkeys + 1));
+    a->index   = ealloc(sizeof(NLActionIndex));
+    a->index->names = g_hash_table_new(g_str_hash, g_str_equal);
 
     size_t i;
-    for (i = 0; i < a->count; i++) {
-        if (i % 2)
-            names[i / 2] = a->actions[i];
-        else
-            keys[i / 2]  = a->actions[i];
+    for (i = 0; i < nkeys; i++) {
+        a->keys[i]  = actions[2 * i];
+        a->names[i] = actions[2 * i + 1];
+
+        // The first occurrence of a key wins, as it always has.
+        if (!g_hash_table_contains(a->index->names, a->keys[i]))
+            g_hash_table_insert(a->index->names, a->keys[i], a->names[i]);
     }
-    a->keys  = keys;
-    a->names = names;
+    a->keys[nkeys]  = NULL;
+    a->names[nkeys] = NULL;
+
+    return a;
 }
 
 extern const char **nl_action_keys(const NLNote *n) {
-    if (!n) return NULL;
-    if (n->actions->keys == NULL)
-        init_keys_names(n->actions);
+    if (!n || !n->actions) return NULL;
     return (const char **)n->actions->keys;
 }
 
@@ -210,25 +443,16 @@ extern const char *nl_action_name(const NLNote *n, const char *key) {
     if (a == NULL)
         return NULL;
 
-    if (a->keys == NULL)
-        init_keys_names(a);
-
-    size_t i;
-    size_t nkeys = a->count / 2;
-    for (i = 0; i < nkeys; i++) {
-        if (!strcmp(key, a->keys[i]))
-            return a->names[i];
-    }
-    return NULL;
+    return g_hash_table_lookup(a->index->names, key);
 }
 
 extern void free_actions(NLActions *a) {
     if (!a) return;
 
-    if (a->keys != NULL)
-        free(a->keys);
-    if (a->names != NULL)
-        free(a->names);
+    g_hash_table_unref(a->index->names);
+    free(a->index);
+    free(a->keys);
+    free(a->names);
 
     g_strfreev(a->actions);
     free(a);
@@ -238,19 +462,133 @@ extern void free_actions(NLActions *a) {
 extern void free_note(NLNote *n) {
     if (!n) return;
 
-    g_free(n->appname);
+    intern_unref(n->appname);
+    intern_unref(n->sender);
     g_free(n->summary);
     g_free(n->body);
 
 #if NL_ACTIONS
     free_actions(n->actions);
 #endif
+#if NL_IMAGES
+    nl_image_unref(n->image);
+#endif
+#if NL_MARKUP
+    free(n->markup);
+#endif
 
-    g_variant_dict_unref(n->hints->dict);
-    free(n->hints);
+    free_hints(n->hints);
     free(n);
 }
 
+// Approximately how many bytes the given value takes up.  This walks the
+// value rather than serializing it, since that would mean copying it.
+extern size_t variant_size(GVariant *v) {
+    if (!g_variant_is_container(v))
+        return g_variant_get_size(v);
+
+    if (g_variant_is_of_type(v, G_VARIANT_TYPE_BYTESTRING)) {
+        gsize len;
+        g_variant_get_fixed_array(v, &len, 1);
+        return len;
+    }
+
+    size_t size = 0;
+    GVariantIter iter;
+    GVariant *child;
+    g_variant_iter_init(&iter, v);
+    while ((child = g_variant_iter_next_value(&iter))) {
+        size += variant_size(child);
+        g_variant_unref(child);
+    }
+    return size;
+}
+
+static size_t str_size(const char *s) {
+    return s != NULL ? strlen(s) + 1 : 0;
+}
+
+// Approximately how many bytes the given note takes up.  Images are shared,
+// but are counted in full against every note that uses them; app names are
+// interned, and aren't counted at all.
+extern size_t note_size(const NLNote *n) {
+    size_t size = sizeof(NLNote);
+
+    size += str_size(n->summary);
+    size += str_size(n->body);
+
+#if NL_ACTIONS
+    if (n->actions != NULL) {
+        size_t i;
+        size += sizeof(NLActions) + 2 * sizeof(char *) * (n->actions->count + 1);
+        for (i = 0; i < n->actions->count; i++)
+            size += str_size(n->actions->actions[i]);
+    }
+#endif
+#if NL_IMAGES
+    if (n->image != NULL)
+        size += n->image->len;
+#endif
+#if NL_MARKUP
+    if (n->markup != NULL)
+        size += sizeof(NLMarkup) + sizeof(NLSpan) * n->markup->nspans
+              + n->markup->len + 1;
+#endif
+    if (n->hints != NULL)
+        size += sizeof(NLHints) + n->hints->size;
+
+    return size;
+}
+
+// Rebuilds the arguments to a Notify call which would reopen the given note
+// in place, with the given timeout.  The app icon is not kept, so is empty.
+extern GVariant *note_to_variant(const NLNote *n, int32_t timeout) {
+    GVariantBuilder actions, hints;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    g_variant_builder_init(&actions, G_VARIANT_TYPE_STRING_ARRAY);
+#if NL_ACTIONS
+    if (n->actions != NULL) {
+        size_t i;
+        for (i = 0; i < n->actions->count; i++)
+            g_variant_builder_add(&actions, "s", n->actions->actions[i]);
+    }
+#endif
+
+    g_variant_builder_init(&hints, G_VARIANT_TYPE_VARDICT);
+    if (n->hints != NULL) {
+        g_hash_table_iter_init(&iter, n->hints->table);
+        while (g_hash_table_iter_next(&iter, &key, &value))
+            g_variant_builder_add(&hints, "{sv}",
+                                  g_quark_to_string(GPOINTER_TO_UINT(key)), value);
+        if (n->hints->other != NULL) {
+            g_hash_table_iter_init(&iter, n->hints->other);
+            while (g_hash_table_iter_next(&iter, &key, &value))
+                g_variant_builder_add(&hints, "{sv}", (const char *)key, value);
+        }
+    }
+#if NL_IMAGES
+    // The image's hint was taken out when the note was decoded.
+    if (n->image != NULL) {
+        const NLImage *img = n->image;
+        GVariant *data = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE,
+                                                   img->data, img->len, 1);
+        g_variant_builder_add(&hints, "{sv}", "image-data",
+                              g_variant_new("(iiibii@ay)", img->width, img->height,
+                                            img->rowstride, img->has_alpha,
+                                            img->bits_per_sample, img->channels,
+                                            data));
+    }
+#endif
+
+    return g_variant_new("(susssasa{sv}i)",
+                         n->appname, n->id, "",
+                         n->summary ? n->summary : "",
+                         n->body ? n->body : "",
+                         &actions, &hints, timeout);
+}
+
 static int32_t dto = 5000;
 
 extern void nl_set_default_timeout(unsigned int new) {
@@ -40,17 +40,76 @@ extern void *ealloc(size_t n) {
     return r;
 }
 
+// Attaches src to the context notlib runs on, calling fn when it fires, and
+// drops our reference to it.
+extern guint add_source(GSource *src, GSourceFunc fn) {
+    g_source_set_callback(src, fn, NULL, NULL);
+    guint id = g_source_attach(src, main_context);
+    g_source_unref(src);
+    return id;
+}
+
+// g_source_remove only looks in the global default context.
+extern void remove_source(guint id) {
+    GSource *src = g_main_context_find_source_by_id(main_context, id);
+    if (src != NULL)
+        g_source_destroy(src);
+}
+
 extern void nl_close_note(unsigned int id) {
     queue_close(id, CLOSE_REASON_DISMISSED);
 }
 
-extern void notlib_run(NLNoteCallbacks cbs, char **caps, NLServerInfo *info) {
+extern void nl_close_notes(const unsigned int *ids, size_t count) {
+    queue_close_ids(ids, count, CLOSE_REASON_DISMISSED);
+}
+
+extern void nl_close_app(const char *appname) {
+    queue_close_app(appname, CLOSE_REASON_DISMISSED);
+}
+
+extern void nl_close_all(void) {
+    queue_close_all(CLOSE_REASON_DISMISSED);
+}
+
+static void setup(NLNoteCallbacks cbs, char **caps, NLServerInfo *info) {
     callbacks = cbs;
     server_capabilities = caps;
     server_info = info;
 
+#if NL_SEARCH
+    history_set_evict_hook(search_forget);
+#endif
+}
+
+#if NL_SINGLE_THREAD
+
+extern void notlib_run(NLNoteCallbacks cbs, char **caps, NLServerInfo *info) {
+    setup(cbs, caps, info);
+    run_dbus_loop(NULL);
+}
+
+extern void nl_attach(NLNoteCallbacks cbs, char **caps, NLServerInfo *info,
+                      GMainContext *ctx) {
+    setup(cbs, caps, info);
+    main_context = ctx;
+    dbus_start();
+}
+
+#else
+
+extern void notlib_run(NLNoteCallbacks cbs, char **caps, NLServerInfo *info) {
+    setup(cbs, caps, info);
+
+    watchdog_start();
+
     pthread_t tid;
     pthread_create(&tid, NULL, run_dbus_loop, NULL);
 
     queue_listen();
+
+    // Only reached once we've handed over to a successor.
+    pthread_join(tid, NULL);
 }
+
+#endif
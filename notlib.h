@@ -46,12 +46,39 @@
 #define NL_TAGS 0
 #endif
 
+#ifndef NL_IMAGES
+#define NL_IMAGES 1
+#endif
+
+#ifndef NL_BATCH
+#define NL_BATCH 0
+#endif
+
+#ifndef NL_MARKUP
+#define NL_MARKUP 0
+#endif
+
+#ifndef NL_SEARCH
+#define NL_SEARCH 0
+#endif
+
+#ifndef NL_SINGLE_THREAD
+#define NL_SINGLE_THREAD 0
+#endif
+
+#ifndef NL_STD_HINTS
+#define NL_STD_HINTS 1
+#endif
+
 #if NL_ACTIONS
+typedef struct action_index NLActionIndex;
+
 typedef struct {
     char **actions;
     char **keys;
     char **names;
     size_t count;
+    NLActionIndex *index;
 } NLActions;
 #endif
 
@@ -66,6 +93,66 @@ enum NLUrgency {
 };
 #endif
 
+#if NL_IMAGES
+typedef struct {
+    int width;
+    int height;
+    int rowstride;
+    int has_alpha;
+    int bits_per_sample;
+    int channels;
+    const unsigned char *data;
+    size_t len;
+} NLImage;
+#endif
+
+#if NL_MARKUP
+enum NLSpanStyle {
+    SPAN_BOLD      = 1 << 0,
+    SPAN_ITALIC    = 1 << 1,
+    SPAN_UNDERLINE = 1 << 2,
+    SPAN_LINK      = 1 << 3,
+    SPAN_IMAGE     = 1 << 4
+};
+
+typedef struct {
+    size_t start;           /* byte offset into NLMarkup.text */
+    size_t len;
+    unsigned int style;     /* bitwise OR of NLSpanStyles */
+    const char *href;       /* link target or image source, or NULL */
+    const char *alt;        /* image alt text, or NULL */
+} NLSpan;
+
+typedef struct {
+    const char *text;       /* the body without markup, entities decoded */
+    size_t len;
+    const NLSpan *spans;    /* in order, covering all of text */
+    size_t nspans;
+} NLMarkup;
+#endif
+
+enum NLRuleAction {
+    RULE_DROP        = 1,   /* don't open the note at all */
+    RULE_SET_TIMEOUT = 2,   /* set its timeout to value */
+    RULE_SET_URGENCY = 3,   /* set its urgency to value (needs NL_URGENCY) */
+    RULE_SET_TAG     = 4    /* set its tag to tag (needs NL_TAGS) */
+};
+
+typedef struct {
+    /* What a note must match; NULL or 0 matches anything.  App names and
+     * categories match exactly, or by prefix if the pattern ends in '*'.
+     * Summaries and bodies match Perl-style regular expressions. */
+    const char *appname;
+    const char *category;
+    const char *summary;
+    const char *body;
+    unsigned int urgencies; /* bitmask of (1 << urgency) */
+
+    enum NLRuleAction action;
+    int value;
+    const char *tag;
+} NLRule;
+
 typedef struct hints NLHints;
 
 enum NLHintType {
@@ -86,9 +173,48 @@ typedef struct {
     } d;
 } NLHint;
 
+#if NL_STD_HINTS
+/*
+ * The standard hints decoded into every note's NLStdHints, as
+ * ENTRY(NAME, field, key, GVariant type, C type).  A build may define its own
+ * table, with the same types, before including notlib.h; notlib and the
+ * server must then both be built with it.
+ */
+#ifndef NL_STD_HINT_TABLE
+#define NL_STD_HINT_TABLE(ENTRY) \
+    ENTRY(CATEGORY,       category,       "category",       STRING,  const char *) \
+    ENTRY(DESKTOP_ENTRY,  desktop_entry,  "desktop-entry",  STRING,  const char *) \
+    ENTRY(IMAGE_PATH,     image_path,     "image-path",     STRING,  const char *) \
+    ENTRY(RESIDENT,       resident,       "resident",       BOOLEAN, int)          \
+    ENTRY(TRANSIENT,      transient,      "transient",      BOOLEAN, int)          \
+    ENTRY(X,              x,              "x",              INT32,   int)          \
+    ENTRY(Y,              y,              "y",              INT32,   int)          \
+    ENTRY(SUPPRESS_SOUND, suppress_sound, "suppress-sound", BOOLEAN, int)          \
+    ENTRY(VALUE,          value,          "value",          INT32,   int)
+#endif
+
+enum NLStdHint {
+#define NL_STD_HINT_ENUM(NAME, field, key, type, ctype) STD_HINT_##NAME,
+    NL_STD_HINT_TABLE(NL_STD_HINT_ENUM)
+#undef NL_STD_HINT_ENUM
+    STD_HINT_COUNT
+};
+
+/* Strings point into the note's hints, and live as long as the note. */
+typedef struct {
+    unsigned int present;   /* bit (1 << STD_HINT_x) set for each hint sent */
+#define NL_STD_HINT_FIELD(NAME, field, key, type, ctype) ctype field;
+    NL_STD_HINT_TABLE(NL_STD_HINT_FIELD)
+#undef NL_STD_HINT_FIELD
+} NLStdHints;
+
+#define nl_has_std_hint(n, h) (((n)->std.present >> (h)) & 1u)
+#endif
+
 typedef struct {
     unsigned int id;
-    char *appname;
+    const char *appname;    /* interned; compare by pointer */
+    const char *sender;     /* client's unique bus name, or NULL */
     char *summary;
     char *body;
 
@@ -99,14 +225,64 @@ typedef struct {
 
 #if NL_URGENCY
     enum NLUrgency urgency;
+#endif
+#if NL_IMAGES
+    NLImage *image;
+#endif
+#if NL_MARKUP
+    NLMarkup *markup;
+#endif
+#if NL_STD_HINTS
+    NLStdHints std;
 #endif
     NLHints *hints;
 } NLNote;
 
+typedef struct {
+    unsigned int id;
+    unsigned int reason;    /* as in the NotificationClosed signal */
+    long long opened;       /* wall-clock microseconds, or 0 if never shown */
+    long long closed;
+    int urgency;            /* -1 if notlib doesn't handle urgency */
+    const char *appname;
+    const char *summary;
+    const char *body;
+} NLHistoryEntry;
+
+/* Identifies one call to an async callback, to be passed to nl_complete. */
+typedef struct {
+    unsigned int id;
+    unsigned int serial;
+} NLCompletion;
+
+/* An app's open notes, taken together. */
+typedef struct {
+    const char *appname;
+    size_t count;               /* 0 once the app's last note has closed */
+    size_t bytes;               /* as counted by the memory budget */
+    unsigned int newest;        /* ID of the most recently opened, or 0 */
+#if NL_URGENCY
+    enum NLUrgency urgency;     /* highest, or URG_NONE */
+#endif
+} NLGroup;
+
 typedef struct {
     void (*notify)  (const NLNote *);
     void (*close)   (const NLNote *);  // Should this include CloseReason?
     void (*replace) (const NLNote *);
+
+    /* If set, called instead of notify and replace.  The note's expiry only
+     * starts once the server calls nl_complete with the given token. */
+    void (*notify_async)  (const NLNote *, NLCompletion);
+    void (*replace_async) (const NLNote *, NLCompletion);
+
+    /* If set, called once for each app whose group changed, after each event
+     * which changed it. */
+    void (*group) (const NLGroup *);
+
+    /* If set, called instead of notify and replace for the notes held while
+     * paused, all at once, when notlib resumes. */
+    void (*batch) (const NLNote **, size_t);
 } NLNoteCallbacks;
 
 typedef struct {
@@ -115,6 +291,42 @@ typedef struct {
     char *version;
 } NLServerInfo;
 
+/* Caps on the parts of each notification; 0 means unlimited. */
+typedef struct {
+    size_t summary_bytes;
+    size_t body_bytes;
+    size_t hints;
+#if NL_ACTIONS
+    size_t actions;             /* key-name pairs */
+#endif
+#if NL_IMAGES
+    size_t image_bytes;         /* of a raw image hint, as sent */
+#endif
+} NLLimits;
+
+/* How often each limit has been hit, since startup. */
+typedef struct {
+    unsigned long summaries_truncated;
+    unsigned long bodies_truncated;
+    unsigned long bytes_truncated;  /* cut from summaries and bodies */
+    unsigned long hints_dropped;
+#if NL_ACTIONS
+    unsigned long actions_dropped;
+#endif
+#if NL_IMAGES
+    unsigned long images_dropped;
+#endif
+} NLLimitCounters;
+
+/* What the watchdog saw when it found a stall. */
+typedef struct {
+    const char *callback;       /* e.g. "notify", or NULL if none running */
+    unsigned int id;            /* the note it was called for */
+    unsigned int running_ms;    /* how long it has been running */
+    size_t queue_depth;         /* events waiting for the callback thread */
+    unsigned int queue_age_ms;  /* how long the oldest has waited */
+} NLStall;
+
 /* public functions */
 
 /*
@@ -133,6 +345,26 @@ extern int nl_get_byte_hint    (const NLNote *n, const char *key, unsigned char
 extern int nl_get_boolean_hint (const NLNote *n, const char *key, int *out);
 extern int nl_get_string_hint  (const NLNote *n, const char *key, const char **out);
 
+/*
+ * Raw image hints.  Identical images are shared between notes, so an NLImage
+ * must be treated as read-only.  It lives as long as its note, unless the
+ * caller takes a reference of its own.
+ */
+
+#if NL_IMAGES
+extern const NLImage *nl_get_image (const NLNote *);
+extern NLImage *nl_image_ref       (const NLImage *);
+extern void nl_image_unref         (NLImage *);
+#endif
+
+/*
+ * Body markup, parsed once when the note arrives.  Lives as long as its note.
+ */
+
+#if NL_MARKUP
+extern const NLMarkup *nl_get_markup(const NLNote *);
+#endif
+
 /*
  * Interacting with actions.
  */
@@ -143,19 +375,161 @@ extern int nl_get_string_hint  (const NLNote *n, const char *key, const char **o
 // if an action was, indeed, invoked.
 extern int nl_invoke_action        (unsigned int id, const char *key);
 
+// Returns the NULL-terminated list of action keys, in the order the client
+// sent them.  nl_action_name is a constant-time lookup.
 extern const char **nl_action_keys (const NLNote *);
 extern const char *nl_action_name  (const NLNote *, const char *);
 #endif
 
+/*
+ * History of closed notes.  Disabled unless nl_set_history_size is called
+ * with a nonzero size, in which case that many bytes are set aside for it up
+ * front; the oldest entries are dropped to make room for new ones.
+ *
+ * The strings in an NLHistoryEntry point into the history itself, and are
+ * only good until the next note closes; that is, they're safe to use from
+ * callbacks, but should be copied if they're needed elsewhere.
+ * nl_history_foreach goes from oldest to newest, and returns the number of
+ * entries it visited; its callback must not call any other nl_history_
+ * function.
+ */
+
+extern void nl_set_history_size(size_t bytes);
+extern int nl_history_lookup(unsigned int id, NLHistoryEntry *out);
+extern size_t nl_history_foreach(void (*)(const NLHistoryEntry *, void *), void *);
+
+/*
+ * Full-text search over open notes, and closed notes still in the history.
+ * Matches notes containing every word of the query, the last word by prefix,
+ * and writes up to max of their IDs to out, most recently opened first.
+ * Returns how many were written.  Safe to call from any thread.
+ */
+
+#if NL_SEARCH
+extern size_t nl_search(const char *query, unsigned int *out, size_t max);
+#endif
+
 /*
  * Main entry point(s).
  *
  * Notlib generates a new pthread to listen for D-Bus messages and queue events.
  * Callbacks are made synchronously in the same thread which invokes notlib_run.
+ * notlib_run only returns once it has handed over to a successor (see
+ * nl_set_handover_socket).
+ *
+ * With NL_SINGLE_THREAD, no thread is created: notlib_run handles D-Bus
+ * messages, expiry and callbacks all on the calling thread.  Alternatively,
+ * nl_attach sets all of that up on the given GMainContext (NULL for the
+ * global default) and returns at once; the caller runs the context, and must
+ * make every other notlib call from the thread running it.
  */
 extern void notlib_run(NLNoteCallbacks, char **, NLServerInfo*);
 
+#if NL_SINGLE_THREAD
+struct _GMainContext;
+extern void nl_attach(NLNoteCallbacks, char **, NLServerInfo *, struct _GMainContext *);
+#endif
+
 extern void nl_close_note(unsigned int);
+
+// Pauses and resumes expiry, e.g. for do-not-disturb.  While paused, open
+// notes' timeouts stand still, and new notes are held back; on resuming,
+// they are opened together.  May be called from any thread (but see
+// NL_SINGLE_THREAD).
+extern void nl_pause(void);
+extern void nl_resume(void);
+
+// If set, only the newest note held for each app is opened on resuming, and
+// the rest are closed as expired.  Defaults to false.
+extern void nl_set_pause_collapse(int);
+
+// Copies out an app's group, returning false if it has no open notes.  Must be
+// called from the callback thread, e.g. from within a callback.
+extern int nl_get_group(const char *appname, NLGroup *out);
+
+// Finishes an async notify or replace.  May be called from any thread, or with
+// NL_SINGLE_THREAD, from the one running notlib.
+extern void nl_complete(NLCompletion);
+
+// Bulk versions of nl_close_note.  Each of these is handled as a single queue
+// operation, however many notes it ends up closing.
+extern void nl_close_notes(const unsigned int *, size_t);
+extern void nl_close_app(const char *);
+extern void nl_close_all(void);
 extern void nl_set_default_timeout(unsigned int);
 
+// Caps on the memory used by, and number of, open notes; first across all
+// apps, and then per app.  When a new note puts either over budget, the
+// oldest open notes with the lowest urgency are expired until it isn't.  0
+// means unlimited, which is the default.
+extern void nl_set_memory_budget(size_t bytes, size_t count);
+extern void nl_set_app_budget(size_t bytes, size_t count);
+
+// If set, notlib also listens on a private Unix socket at this path, serving
+// the same interface as on the session bus.  Local clients running as the
+// same user may connect straight to it and skip the bus daemon.  Must be
+// called before notlib_run.
+extern void nl_set_peer_socket(const char *);
+
+// Sets the rules each notification is run through as it arrives, before
+// anything is allocated for it.  Every matching rule applies, in order, so
+// later rules win; a dropped note is given ID 0 and opens nothing.  Copies
+// and compiles the rules, and returns false (keeping no rules) if any is
+// invalid.  Must be called before notlib_run.
+extern int nl_set_rules(const NLRule *, size_t);
+
+// If set, a restarted server takes over from the running one without losing
+// any notes: the new process connects to the old one on a Unix socket at this
+// path, takes the bus name from it, and receives its open notes and claimed
+// IDs.  The old process's notlib_run then returns.  Must be called before
+// notlib_run.
+extern void nl_set_handover_socket(const char *);
+
+#if !NL_SINGLE_THREAD
+// Watches for a callback running longer than callback_ms, or a queued event
+// waiting longer than queue_ms (either 0 to not watch), and logs each stall
+// to stderr, along with the callback thread's backtrace if asked.  hook, if
+// non-NULL, is then called with the details, on the D-Bus thread.  Must be
+// called before notlib_run.
+extern void nl_set_watchdog(unsigned int callback_ms, unsigned int queue_ms,
+                            int backtrace, void (*hook)(const NLStall *));
+#endif
+
+#if !NL_SINGLE_THREAD
+// If nonzero, Notify calls are only given their IDs on the D-Bus thread, and
+// their notes built on this many threads of their own, then queued in the
+// order the calls came.  Defaults to 0.  Must be called before notlib_run.
+extern void nl_set_decode_threads(unsigned int);
+#endif
+
+// If set, NotificationClosed and ActionInvoked signals for a note are sent
+// only to the client which sent it, rather than broadcast, where it is known.
+// Defaults to false.
+extern void nl_set_unicast_signals(int);
+
+// Publishes open notes to a POSIX shared memory object of this name (see
+// shm_open) and size, laid out as described in notlib_shm.h, so that other
+// processes can read them without asking over D-Bus.  Returns false if the
+// object can't be created.  Must be called before notlib_run.
+extern int nl_set_shm_export(const char *name, size_t size);
+
+// Limits the size of each part of a notification.  Summaries and bodies over
+// their limit are cut short at a character boundary, and hints and actions
+// past theirs, and images over theirs, are dropped, all as the call is
+// decoded.  Must be called before notlib_run.  nl_get_limit_counters may be
+// called from any thread.
+extern void nl_set_limits(const NLLimits *);
+extern void nl_get_limit_counters(NLLimitCounters *);
+
+// If set, every Notify, CloseNotification(s) and InvokeAction call is logged,
+// with its arrival time, to a binary trace at this path, which tools/nlreplay
+// can play back.  Truncates the file, and returns false if it can't be
+// opened.  Must be called before notlib_run.
+extern int nl_set_capture_file(const char *);
+
+// If nonzero, a notification identical to one opened less than this many
+// milliseconds ago, which is still open, is folded into the open one: that
+// note's expiry is reset and the client is given its ID.  Defaults to 0.
+extern void nl_set_dedup_window(unsigned int);
+
 #endif
@@ -0,0 +1,106 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The layout of the shared memory region notlib publishes open notes to (see
+ * nl_set_shm_export), for programs reading it.  Needs nothing but this
+ * header, and shm_open and mmap.
+ *
+ * The region is a header, a table of note entries, and an area of strings.
+ * Opening a note appends an entry, and its strings; closing it clears the
+ * entry's NLSHM_LIVE flag.  When either runs out, the live entries are
+ * compacted to the front and the generation bumped.
+ *
+ * Every change is made inside a seqlock: seq is odd while the region is
+ * being written.  Readers read in place, and check with nlshm_read_retry
+ * that nothing changed underneath them before trusting what they read:
+ *
+ *   uint64_t seq;
+ *   do {
+ *       seq = nlshm_read_begin(h);
+ *       ... copy out whatever is needed ...
+ *   } while (nlshm_read_retry(h, seq));
+ *
+ * A torn read may see nonsense offsets, so readers should check indices
+ * against max_entries before calling nlshm_entry.  nlshm_string clamps its
+ * offset, and the region always ends in a NUL, so string reads stay in
+ * bounds whatever they see.
+ */
+
+#ifndef NOTLIB_SHM_H
+#define NOTLIB_SHM_H
+
+#include <stdint.h>
+
+#define NLSHM_MAGIC   0x48534c4eu   /* "NLSH", little-endian */
+#define NLSHM_VERSION 1
+
+#define NLSHM_LIVE    1u
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t seq;           /* odd while being written */
+    uint64_t size;          /* of the whole region */
+    uint64_t generation;    /* bumped whenever entries move */
+
+    uint64_t entries_off;   /* offset of the first NLShmNote */
+    uint32_t max_entries;
+    uint32_t nentries;      /* entries in use, live or not */
+    uint32_t live;          /* entries with NLSHM_LIVE set */
+    uint32_t dropped;       /* notes which didn't fit, ever */
+
+    uint64_t strings_off;   /* offset of the string area */
+    uint64_t strings_size;
+    uint64_t strings_used;
+} NLShmHeader;
+
+typedef struct {
+    uint32_t id;
+    uint32_t flags;
+    int64_t opened;         /* wall-clock microseconds */
+    int32_t urgency;        /* -1 if notlib was built without NL_URGENCY */
+    int32_t timeout;
+    uint32_t appname;       /* offsets into the string area, of */
+    uint32_t summary;       /* NUL-terminated UTF-8 */
+    uint32_t body;
+    uint32_t pad;
+} NLShmNote;
+
+static inline uint64_t nlshm_read_begin(const NLShmHeader *h) {
+    uint64_t seq;
+    while ((seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    return seq;
+}
+
+static inline int nlshm_read_retry(const NLShmHeader *h, uint64_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline const NLShmNote *nlshm_entry(const NLShmHeader *h, uint32_t i) {
+    return (const NLShmNote *)((const char *)h + h->entries_off) + i;
+}
+
+static inline const char *nlshm_string(const NLShmHeader *h, uint32_t off) {
+    if (off >= h->strings_size)
+        off = h->strings_size;     /* the final NUL */
+    return (const char *)h + h->strings_off + off;
+}
+
+#endif  // NOTLIB_SHM_H
@@ -27,27 +27,68 @@
  * CORE DATA STRUCTURE -- qnode
  */
 
-#define QUEUE_NOTIFY (CLOSE_REASON_MAX + 1)
+#define QUEUE_NOTIFY     (CLOSE_REASON_MAX + 1)
+#define QUEUE_CLOSE_MANY (CLOSE_REASON_MAX + 2)
+#define QUEUE_HANDOVER   (CLOSE_REASON_MAX + 3)
+#define QUEUE_COMPLETE   (CLOSE_REASON_MAX + 4)
+#define QUEUE_RESUME     (CLOSE_REASON_MAX + 5)
+
+/* With NL_SINGLE_THREAD, everything happens on one thread, so the queues
+ * need no locks at all. */
+#if NL_SINGLE_THREAD
+#define QUEUE_LOCK(queue)   ((void)&(queue))
+#define QUEUE_UNLOCK(queue) ((void)&(queue))
+#else
+#define QUEUE_LOCK(queue)   pthread_mutex_lock(&(queue).lock)
+#define QUEUE_UNLOCK(queue) pthread_mutex_unlock(&(queue).lock)
+#endif
 
 #define LOCKED(queue, expr) do { \
-    pthread_mutex_lock(&(queue).lock); \
+    QUEUE_LOCK(queue); \
     expr; \
-    pthread_mutex_unlock(&(queue).lock); \
+    QUEUE_UNLOCK(queue); \
 } while (0);
 
+/* Calls into the server, under the watchdog's eye. */
+#if NL_SINGLE_THREAD
+#define WATCHED(kind, id, call) call
+#else
+#define WATCHED(kind, id, call) do { \
+    watchdog_enter(kind, id); \
+    call; \
+    watchdog_leave(); \
+} while (0)
+#endif
+
+/* Which notes a QUEUE_CLOSE_MANY closes. */
+typedef struct {
+    enum CloseReason reason;
+    GHashTable *ids;        /* if non-NULL, the set of IDs to close */
+    const char *appname;    /* if non-NULL, the (interned) app to close */
+} close_many;
+
 typedef struct qn {
     NLNote *n;
     uint32_t id;
 
     int64_t exp;
+    int64_t opened;         /* wall-clock time the note was first shown, or 0 */
+    int64_t queued;         /* when the event was last queued */
+    uint32_t serial;        /* if nonzero, the outstanding async callback */
     int action;
     char *tag;
+    close_many *many;
+    size_t size;            /* bytes counted against the budget, if open */
+    struct qn *gprev;       /* neighbours in the app's group, if open */
+    struct qn *gnext;
     struct qn *prev;
     struct qn *next;
 } qnode;
 
 typedef struct {
+#if !NL_SINGLE_THREAD
     pthread_mutex_t lock;
+#endif
     qnode *start;
     qnode *end;
 } queue;
@@ -56,23 +97,39 @@ typedef struct {
  * QUEUES
  *  - notify queue: changes that need to be propagated
  *  - timeout queue: notifications waiting to expire
+ *  - hold queue: new notifications held while paused
  */
 
+#if !NL_SINGLE_THREAD
 pthread_cond_t nq_cond = PTHREAD_COND_INITIALIZER;
+#endif
 
 queue notify_queue = {
+#if !NL_SINGLE_THREAD
     .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
     .start = NULL,
     .end = NULL
 };
 queue timeout_queue = {
+#if !NL_SINGLE_THREAD
     .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
+    .start = NULL,
+    .end = NULL
+};
+/* Guarded by the notify queue's mutex; its own is never used. */
+queue hold_queue = {
+#if !NL_SINGLE_THREAD
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+#endif
     .start = NULL,
     .end = NULL
 };
 
 
 NLNoteCallbacks callbacks;
+GMainContext *main_context = NULL;
 
 /* Callers MUST lock the queue's mutex before calling!! */
 static void queue_insert(queue *q, qnode *qn) {
@@ -139,15 +196,317 @@ static qnode *queue_yank_id(queue *q, uint32_t id) {
     return qn;
 }
 
+/* Like queue_find_id, but skips over pending closes which carry no note. */
+static qnode *queue_find_note(queue *q, uint32_t id) {
+    qnode *qn;
+    for (qn = q->start; qn; qn = qn->next) {
+        if (qn->id == id && qn->n != NULL)
+            return qn;
+    }
+    return NULL;
+}
+
+/* Like queue_yank_id, but skips over pending closes which carry no note.
+ * Callers MUST lock the queue's mutex before calling!! */
+static qnode *queue_yank_note(queue *q, uint32_t id) {
+    qnode *qn = queue_find_note(q, id);
+    if (qn == NULL)
+        return NULL;
+    queue_yank(q, qn);
+    return qn;
+}
+
+/* Moves everything in `in` into q, keeping both in the order it was queued.
+ * Callers MUST lock q's mutex before calling!! */
+static void queue_merge(queue *q, queue *in) {
+    qnode *at = q->start;
+    qnode *qn;
+    while ((qn = queue_yank_first(in)) != NULL) {
+        while (at != NULL && at->queued <= qn->queued)
+            at = at->next;
+        if (at == NULL) {
+            queue_insert(q, qn);
+            continue;
+        }
+        qn->next = at;
+        qn->prev = at->prev;
+        if (at->prev != NULL)
+            at->prev->next = qn;
+        else
+            q->start = qn;
+        at->prev = qn;
+    }
+}
+
+static qnode *new_qn(uint32_t id, int action) {
+    qnode *qn = ealloc(sizeof(qnode));
+    memset(qn, 0, sizeof(qnode));
+    qn->id = id;
+    qn->action = action;
+    return qn;
+}
+
+static void free_close_many(close_many *m) {
+    if (m->ids != NULL)
+        g_hash_table_unref(m->ids);
+    intern_unref(m->appname);
+    free(m);
+}
+
+static void budget_release(qnode *);
+static void note_closed(qnode *, enum CloseReason);
+
 static void free_qn(qnode *qn) {
+    if (qn->size != 0)
+        budget_release(qn);
     if (qn->n != NULL)
         free_note(qn->n);
     if (qn->tag != NULL)
         free(qn->tag);
+    if (qn->many != NULL)
+        free_close_many(qn->many);
     free(qn);
 }
 
 
+/**
+ * GROUPS AND MEMORY BUDGET
+ *
+ * Open notes are grouped by app, and each group keeps its count, size,
+ * newest note and highest urgency up to date as notes open and close, along
+ * with a list of its notes, oldest first.  Groups which change while an event
+ * is handled are passed to the group callback once it has been.
+ *
+ * Resident notes never expire on their own, so a leaky client can otherwise
+ * keep an unbounded number of them open.  When all open notes, or an app's
+ * group, are over budget, the oldest notes of the lowest urgency are expired
+ * to make room.
+ *
+ * Groups and the budget are only ever touched by the callback thread.
+ */
+
+typedef struct {
+    size_t bytes;
+    size_t count;
+} usage;
+
+typedef struct {
+    NLGroup pub;
+    qnode *oldest;
+    qnode *newest;
+#if NL_URGENCY
+    size_t by_urgency[URG_MAX + 1];
+#endif
+    int dirty;
+} group;
+
+static usage budget = { 0, 0 };     /* 0 means unlimited */
+static usage app_budget = { 0, 0 };
+static usage total = { 0, 0 };
+static GHashTable *groups = NULL;       /* interned appname -> group */
+static GPtrArray *dirty_groups = NULL;  /* changed since the last flush */
+
+extern void nl_set_memory_budget(size_t bytes, size_t count) {
+    budget.bytes = bytes;
+    budget.count = count;
+}
+
+extern void nl_set_app_budget(size_t bytes, size_t count) {
+    app_budget.bytes = bytes;
+    app_budget.count = count;
+}
+
+static void free_group(group *g) {
+    intern_unref(g->pub.appname);
+    free(g);
+}
+
+// Groups hold a reference to their app's name, so it outlives the app's last
+// note until the group callback has seen it go.
+static group *group_for_app(const char *app) {
+    if (groups == NULL) {
+        groups = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify)free_group);
+        dirty_groups = g_ptr_array_new();
+    }
+
+    group *g = g_hash_table_lookup(groups, app);
+    if (g == NULL) {
+        g = ealloc(sizeof(group));
+        memset(g, 0, sizeof(group));
+        g->pub.appname = intern_ref(app);
+        g_hash_table_insert(groups, (char *)app, g);
+    }
+    return g;
+}
+
+static void mark_dirty(group *g) {
+    if (!g->dirty) {
+        g->dirty = 1;
+        g_ptr_array_add(dirty_groups, g);
+    }
+}
+
+#if NL_URGENCY
+static int urgency_slot(enum NLUrgency u) {
+    return u < URG_MIN ? URG_MIN : u > URG_MAX ? URG_MAX : u;
+}
+
+static void count_urgency(group *g, enum NLUrgency u, int delta) {
+    int i;
+    g->by_urgency[urgency_slot(u)] += delta;
+    g->pub.urgency = URG_NONE;
+    for (i = URG_MAX; i >= URG_MIN; i--) {
+        if (g->by_urgency[i] > 0) {
+            g->pub.urgency = i;
+            break;
+        }
+    }
+}
+#endif
+
+static void budget_charge(qnode *qn) {
+    qn->size = note_size(qn->n);
+
+    group *g = group_for_app(qn->n->appname);
+    qn->gprev = g->newest;
+    qn->gnext = NULL;
+    if (g->newest != NULL)
+        g->newest->gnext = qn;
+    else
+        g->oldest = qn;
+    g->newest = qn;
+
+    g->pub.count++;
+    g->pub.bytes += qn->size;
+    g->pub.newest = qn->id;
+#if NL_URGENCY
+    count_urgency(g, qn->n->urgency, 1);
+#endif
+    mark_dirty(g);
+
+    total.bytes += qn->size;
+    total.count++;
+}
+
+static void budget_release(qnode *qn) {
+    group *g = g_hash_table_lookup(groups, qn->n->appname);
+
+    if (qn->gprev != NULL)
+        qn->gprev->gnext = qn->gnext;
+    else
+        g->oldest = qn->gnext;
+    if (qn->gnext != NULL)
+        qn->gnext->gprev = qn->gprev;
+    else
+        g->newest = qn->gprev;
+
+    g->pub.count--;
+    g->pub.bytes -= qn->size;
+    g->pub.newest = g->newest != NULL ? g->newest->id : 0;
+#if NL_URGENCY
+    count_urgency(g, qn->n->urgency, -1);
+#endif
+    mark_dirty(g);
+
+    total.bytes -= qn->size;
+    total.count--;
+
+    qn->size = 0;
+}
+
+// Passes each group changed by the last event to the group callback, and
+// drops the ones left empty.
+static void flush_groups(void) {
+    guint i;
+    if (dirty_groups == NULL || dirty_groups->len == 0)
+        return;
+
+    for (i = 0; i < dirty_groups->len; i++) {
+        group *g = g_ptr_array_index(dirty_groups, i);
+        g->dirty = 0;
+        if (callbacks.group != NULL)
+            WATCHED("group", g->pub.newest, callbacks.group(&g->pub));
+        if (g->pub.count == 0)
+            g_hash_table_remove(groups, g->pub.appname);
+    }
+    g_ptr_array_set_size(dirty_groups, 0);
+}
+
+extern int nl_get_group(const char *appname, NLGroup *out) {
+    const char *app = intern_find(appname ? appname : "");
+    group *g;
+
+    if (app == NULL || groups == NULL)
+        return 0;
+    g = g_hash_table_lookup(groups, app);
+    if (g == NULL || g->pub.count == 0)
+        return 0;
+    *out = g->pub;
+    return 1;
+}
+
+static int over_budget(size_t bytes, size_t count, const usage *b) {
+    return (b->bytes && bytes > b->bytes) || (b->count && count > b->count);
+}
+
+// Picks the oldest open note of the lowest urgency, belonging to the given
+// app if there is one, other than the note which was just opened.
+// Callers MUST lock the timeout queue's mutex before calling!!
+static qnode *pick_victim(const char *app, const qnode *keep) {
+    qnode *qn, *victim = NULL;
+    qnode *first = timeout_queue.start;
+    int in_group = 0;
+
+    // An app's notes can be found without looking at anyone else's.
+    if (app != NULL) {
+        group *g = g_hash_table_lookup(groups, app);
+        first = g != NULL ? g->oldest : NULL;
+        in_group = 1;
+    }
+
+    for (qn = first; qn; qn = in_group ? qn->gnext : qn->next) {
+        if (qn == keep || qn->size == 0)
+            continue;
+#if NL_URGENCY
+        if (victim == NULL || qn->n->urgency < victim->n->urgency)
+            victim = qn;
+#else
+        return qn;
+#endif
+    }
+    return victim;
+}
+
+static int evict(const char *app, const qnode *keep) {
+    qnode *victim;
+    LOCKED(timeout_queue, {
+        victim = pick_victim(app, keep);
+        if (victim != NULL)
+            queue_yank(&timeout_queue, victim);
+    });
+    if (victim == NULL)
+        return 0;
+
+    note_closed(victim, CLOSE_REASON_EXPIRED);
+    signal_notification_closed(victim->id, note_dest(victim->n), CLOSE_REASON_EXPIRED);
+    free_qn(victim);
+    return 1;
+}
+
+// Brings everything, and app, back within budget, sparing keep.
+static void budget_enforce(const char *app, const qnode *keep) {
+    group *g;
+
+    while (over_budget(total.bytes, total.count, &budget) && evict(NULL, keep))
+        ;
+    while ((g = g_hash_table_lookup(groups, app))
+            && over_budget(g->pub.bytes, g->pub.count, &app_budget)
+            && evict(app, keep))
+        ;
+}
+
+
 /**
  * CALLBACK THREAD
  */
@@ -155,39 +514,274 @@ static void free_qn(qnode *qn) {
 static int scan_for_timeout(gpointer p);
 static void enqueue(qnode *qn, int action);
 
-static void do_notify(qnode *qn) {
+/*
+ * Pausing.  Expiry runs on a virtual clock, which stands still while notlib
+ * is paused, so pausing and resuming never touch notes' expiry times.  New
+ * notes are held in the hold queue until resumed, then opened together, so
+ * the callback thread never has to step over them.
+ */
+
+static int64_t paused_at = 0;       /* real ms when paused, or 0 */
+static int64_t time_paused = 0;     /* ms spent paused before that */
+static int holding = 0;             /* notify queue: new notes are held */
+static int collapse = 0;
+
+/* Callers MUST lock the timeout queue's mutex before calling!! */
+static int64_t virtual_now(void) {
+    int64_t now = paused_at != 0 ? paused_at : g_get_monotonic_time() / 1000;
+    return now - time_paused;
+}
+
+/*
+ * Asynchronous callbacks.  While a note's notify_async or replace_async
+ * callback is outstanding, the note's ID is busy: its expiry hasn't started,
+ * and further events for it wait in the notify queue, while events for other
+ * IDs go ahead of them.
+ */
+
+static GHashTable *busy = NULL;     /* ID -> serial */
+static uint32_t last_serial = 0;
+
+static uint32_t begin_async(uint32_t id) {
+    if (busy == NULL)
+        busy = g_hash_table_new(g_direct_hash, g_direct_equal);
+    if (++last_serial == 0)
+        last_serial = 1;
+    g_hash_table_insert(busy, GUINT_TO_POINTER(id), GUINT_TO_POINTER(last_serial));
+    return last_serial;
+}
+
+static void end_async(qnode *qn) {
+    g_hash_table_remove(busy, GUINT_TO_POINTER(qn->id));
+    qn->serial = 0;
+}
+
+static int is_busy(uint32_t id) {
+    return busy != NULL && g_hash_table_contains(busy, GUINT_TO_POINTER(id));
+}
+
+// The first event which may be handled now.
+// Callers MUST lock the notify queue's mutex before calling!!
+static qnode *next_ready(void) {
+    qnode *qn;
+    for (qn = notify_queue.start; qn; qn = qn->next) {
+        int per_id = qn->action == QUEUE_NOTIFY || qn->action <= CLOSE_REASON_MAX;
+        if (!per_id || !is_busy(qn->id))
+            return qn;
+    }
+    return NULL;
+}
+
+static NLCompletion token(uint32_t id, uint32_t serial) {
+    NLCompletion c;
+    c.id = id;
+    c.serial = serial;
+    return c;
+}
+
+// Everything that happens when a note closes, short of the signal.
+static void note_closed(qnode *qn, enum CloseReason reason) {
+    int kept = 0;
+    if (qn->serial != 0)
+        end_async(qn);
+    if (callbacks.close != NULL)
+        WATCHED("close", qn->id, callbacks.close(qn->n));
+    if (history_enabled())
+        kept = history_record(qn->n, qn->opened, reason);
+    if (shm_enabled())
+        shm_remove(qn->id);
+#if NL_SEARCH
+    search_close(qn->id, kept);
+#else
+    (void)kept;
+#endif
+}
+
+static void start_expiry(qnode *qn) {
+    int32_t timeout_ms = note_timeout(qn->n);
+    if (timeout_ms == 0) {
+        qn->exp = 0;
+    } else {
+        LOCKED(timeout_queue, qn->exp = virtual_now() + timeout_ms);
+        add_source(g_timeout_source_new(timeout_ms), scan_for_timeout);
+    }
+}
+
+// Opens a note.  Notes released together after a pause are batched: their
+// callbacks and budget are dealt with once all of them are open.
+static void do_notify(qnode *qn, int batched) {
     qnode *replaced = NULL;
     LOCKED(timeout_queue, {
         replaced = queue_yank_id(&timeout_queue, qn->id);
     });
 
-    if (replaced != NULL && callbacks.replace != NULL) {
-        callbacks.replace(qn->n);
-    } else if (replaced == NULL && callbacks.notify != NULL) {
-        callbacks.notify(qn->n);
+    if (batched) {
+        /* see do_resume */
+    } else if (replaced != NULL) {
+        if (callbacks.replace_async != NULL) {
+            qn->serial = begin_async(qn->id);
+            WATCHED("replace_async", qn->id,
+                    callbacks.replace_async(qn->n, token(qn->id, qn->serial)));
+        } else if (callbacks.replace != NULL) {
+            WATCHED("replace", qn->id, callbacks.replace(qn->n));
+        }
+    } else {
+        if (callbacks.notify_async != NULL) {
+            qn->serial = begin_async(qn->id);
+            WATCHED("notify_async", qn->id,
+                    callbacks.notify_async(qn->n, token(qn->id, qn->serial)));
+        } else if (callbacks.notify != NULL) {
+            WATCHED("notify", qn->id, callbacks.notify(qn->n));
+        }
     }
 
+    qn->opened = replaced != NULL ? replaced->opened : g_get_real_time();
+    if (shm_enabled())
+        shm_add(qn->n, qn->opened);
+#if NL_SEARCH
+    search_add(qn->n);
+#endif
+
+    budget_charge(qn);
     LOCKED(timeout_queue, queue_insert(&timeout_queue, qn));
 
     if (replaced != NULL)
         free_qn(replaced);
 
-    int32_t timeout_ms = note_timeout(qn->n);
-    if (timeout_ms == 0) {
-        qn->exp = 0;
-    } else {
-        qn->exp = (g_get_monotonic_time() / 1000) + timeout_ms;
-        g_timeout_add(timeout_ms, scan_for_timeout, NULL);
+    if (!batched)
+        budget_enforce(qn->n->appname, qn);
+
+    if (qn->serial == 0)
+        start_expiry(qn);
+}
+
+// An async callback has finished, so the note's expiry can start.  Tokens
+// for notes which have since closed are ignored.
+static void do_complete(qnode *qn) {
+    qnode *cn;
+    int done = 0;
+
+    LOCKED(timeout_queue, {
+        cn = queue_find_id(&timeout_queue, qn->id);
+        if (cn != NULL && cn->serial != 0 && cn->serial == qn->serial) {
+            end_async(cn);
+            done = 1;
+        }
+    });
+    if (done)
+        start_expiry(cn);
+
+    free_qn(qn);
+}
+
+// Drops a held note which will never be opened.  A collapsed note is closed
+// as though it had been opened and expired straight away, and so is the note
+// it was to replace, if that's open; its client isn't told twice.
+static void drop_held(qnode *qn, int collapsed) {
+    qnode *open = NULL;
+    int expiring = 0;
+
+    if (collapsed) {
+        LOCKED(timeout_queue, open = queue_yank_id(&timeout_queue, qn->id));
+        // Already expired, and queued to be closed.
+        if (open == NULL)
+            LOCKED(notify_queue, expiring = queue_find_note(&notify_queue, qn->id) != NULL);
     }
+
+    if (open != NULL) {
+        note_closed(open, CLOSE_REASON_EXPIRED);
+        signal_notification_closed(open->id, note_dest(open->n), CLOSE_REASON_EXPIRED);
+        free_qn(open);
+    } else if (collapsed && !expiring) {
+        signal_notification_closed(qn->id, note_dest(qn->n), CLOSE_REASON_EXPIRED);
+    }
+    free_qn(qn);
+}
+
+// Opens every note held while paused, newest first per ID (and per app, if
+// collapsing), then hands them all to the batch callback at once.
+static void do_resume(qnode *qn) {
+    queue held = { .start = NULL, .end = NULL };
+    queue waiting = { .start = NULL, .end = NULL };
+    qnode *hn, *hnext, *hprev;
+    int repaused;
+
+    free_qn(qn);
+
+    // Paused again since nl_resume was called.
+    LOCKED(timeout_queue, repaused = paused_at != 0);
+    if (repaused)
+        return;
+
+    // Notes for busy IDs go back among the events waiting on those IDs, in
+    // the order they were queued.
+    LOCKED(notify_queue, {
+        while ((hn = queue_yank_first(&hold_queue)) != NULL)
+            queue_insert(is_busy(hn->id) ? &waiting : &held, hn);
+        queue_merge(&notify_queue, &waiting);
+        holding = 0;
+    });
+
+    GHashTable *ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable *apps = g_hash_table_new(g_direct_hash, g_direct_equal);
+    size_t count = 0;
+
+    // Only the newest note for each ID is worth showing; the client already
+    // has the ID, so the rest go quietly.  Collapsed notes have IDs of their
+    // own, so their clients are told they've closed.
+    for (hn = held.end; hn; hn = hprev) {
+        hprev = hn->prev;
+        const char *app = hn->n->appname;
+        if (g_hash_table_contains(ids, GUINT_TO_POINTER(hn->id))) {
+            queue_yank(&held, hn);
+            drop_held(hn, 0);
+        } else if (collapse && g_hash_table_contains(apps, app)) {
+            g_hash_table_add(ids, GUINT_TO_POINTER(hn->id));
+            queue_yank(&held, hn);
+            drop_held(hn, 1);
+        } else {
+            g_hash_table_add(ids, GUINT_TO_POINTER(hn->id));
+            g_hash_table_add(apps, (char *)app);
+            count++;
+        }
+    }
+    g_hash_table_unref(ids);
+
+    const NLNote **notes = ealloc(sizeof(NLNote *) * (count + 1));
+    count = 0;
+    for (hn = held.start; hn; hn = hnext) {
+        hnext = hn->next;
+        notes[count++] = hn->n;
+        do_notify(hn, callbacks.batch != NULL);
+    }
+
+    if (callbacks.batch != NULL && count > 0) {
+        WATCHED("batch", 0, callbacks.batch(notes, count));
+
+        GHashTableIter iter;
+        gpointer app;
+        g_hash_table_iter_init(&iter, apps);
+        while (g_hash_table_iter_next(&iter, &app, NULL))
+            budget_enforce(app, NULL);
+    }
+
+    free(notes);
+    g_hash_table_unref(apps);
 }
 
+// Closes a note.  Notes held for its ID while paused are dropped without ever
+// being shown, and the client is told once.
 static void do_close(qnode *qn) {
+    queue held = { .start = NULL, .end = NULL };
     qnode *closed = NULL;
+    qnode *hn;
     if (qn->n != NULL) {
         closed = qn;
     } else {
         LOCKED(notify_queue, {
-            closed = queue_yank_id(&notify_queue, qn->id);
+            closed = queue_yank_note(&notify_queue, qn->id);
+            while ((hn = queue_yank_note(&hold_queue, qn->id)) != NULL)
+                queue_insert(&held, hn);
         });
         if (closed == NULL) {
             LOCKED(timeout_queue, {
@@ -196,35 +790,206 @@ static void do_close(qnode *qn) {
         }
     }
     if (closed != NULL) {
-        if (callbacks.close != NULL)
-            callbacks.close(closed->n);
-        signal_notification_closed(closed->n->id, qn->action);
+        note_closed(closed, qn->action);
+        signal_notification_closed(closed->n->id, note_dest(closed->n), qn->action);
         if (closed != qn) {
             free_qn(closed);
         }
+    } else if (held.end != NULL) {
+        signal_notification_closed(qn->id, note_dest(held.end->n), qn->action);
+    }
+
+    while ((hn = queue_yank_first(&held)) != NULL)
+        free_qn(hn);
+    free_qn(qn);
+}
+
+static int close_many_matches(const close_many *m, const qnode *qn) {
+    if (qn->n == NULL)
+        return 0;
+    if (m->ids != NULL)
+        return g_hash_table_contains(m->ids, GUINT_TO_POINTER(qn->id));
+    if (m->appname != NULL)
+        return m->appname == qn->n->appname;
+    return 1;
+}
+
+/* Callers MUST lock the queue's mutex before calling!! */
+static void queue_yank_matching(queue *q, const close_many *m, queue *out) {
+    qnode *qn, *qnext;
+    for (qn = q->start; qn; qn = qnext) {
+        qnext = qn->next;
+        if (!close_many_matches(m, qn))
+            continue;
+        queue_yank(q, qn);
+        queue_insert(out, qn);
+    }
+}
+
+// Closes every matching note in one pass over each queue, rather than one
+// scan (and one lock round trip) per note.  A note yet to be shown goes
+// without a close callback, and an ID both open and about to be replaced is
+// only signalled once.
+static void do_close_many(qnode *qn) {
+    queue closed = { .start = NULL, .end = NULL };
+    qnode *cn, *cnext;
+    size_t count = 0;
+
+    LOCKED(timeout_queue, queue_yank_matching(&timeout_queue, qn->many, &closed));
+    LOCKED(notify_queue, {
+        queue_yank_matching(&notify_queue, qn->many, &closed);
+        queue_yank_matching(&hold_queue, qn->many, &closed);
+    });
+
+    for (cn = closed.start; cn; cn = cn->next)
+        count++;
+
+    uint32_t *ids = ealloc(sizeof(uint32_t) * (count + 1));
+    const char **senders = ealloc(sizeof(char *) * (count + 1));
+    GHashTable *signalled = g_hash_table_new(g_direct_hash, g_direct_equal);
+    count = 0;
+    for (cn = closed.start; cn; cn = cn->next) {
+        // Only notes which have been opened have their open time set.
+        if (cn->opened != 0)
+            note_closed(cn, qn->many->reason);
+        if (g_hash_table_contains(signalled, GUINT_TO_POINTER(cn->id)))
+            continue;
+        g_hash_table_add(signalled, GUINT_TO_POINTER(cn->id));
+        ids[count] = cn->id;
+        senders[count] = note_dest(cn->n);
+        count++;
+    }
+
+    signal_notifications_closed(ids, senders, count, qn->many->reason);
+    g_hash_table_unref(signalled);
+    free(ids);
+    free(senders);
+
+    for (cn = closed.start; cn; cn = cnext) {
+        cnext = cn->next;
+        free_qn(cn);
     }
+    free_qn(qn);
+}
+
+static int listening = 1;
+
+// Hands everything still open over to our successor, and stops listening.
+// Everything queued ahead of this has been dealt with already; anything
+// queued since is either an expiry from the D-Bus thread, which carries its
+// note and is handed over as about to expire, or a close from the server,
+// which is dropped along with the rest of it.
+
+static void do_handover(qnode *qn) {
+    GVariantBuilder notes;
+    int64_t now;
+    qnode *cn;
+
+    g_variant_builder_init(&notes, G_VARIANT_TYPE("a(susssasa{sv}i)"));
+
+    LOCKED(timeout_queue, {
+        now = virtual_now();
+        LOCKED(notify_queue, {
+            for (cn = timeout_queue.start; cn; cn = cn->next) {
+                int32_t timeout = 0;
+                if (cn->serial != 0)
+                    timeout = cn->n->timeout;
+                else if (cn->exp != 0)
+                    timeout = cn->exp > now ? (int32_t)(cn->exp - now) : 1;
+                g_variant_builder_add_value(&notes, note_to_variant(cn->n, timeout));
+            }
+            for (cn = notify_queue.start; cn; cn = cn->next) {
+                if (cn->n == NULL)
+                    continue;
+                g_variant_builder_add_value(&notes, note_to_variant(cn->n,
+                        cn->action == QUEUE_NOTIFY ? cn->n->timeout : 1));
+            }
+            for (cn = hold_queue.start; cn; cn = cn->next)
+                g_variant_builder_add_value(&notes, note_to_variant(cn->n, cn->n->timeout));
+        });
+    });
 
+    shm_stop();
+    handover_send(handover_state(g_variant_builder_end(&notes)));
     free_qn(qn);
+
+    listening = 0;
+    dbus_stop();
+}
+
+static void free_queue(queue *q) {
+    qnode *qn;
+    LOCKED(*q, {
+        while ((qn = queue_yank_first(q)) != NULL)
+            free_qn(qn);
+    });
+}
+
+static void free_queues(void) {
+    qnode *qn;
+    LOCKED(notify_queue, {
+        while ((qn = queue_yank_first(&hold_queue)) != NULL)
+            free_qn(qn);
+    });
+    free_queue(&notify_queue);
+    free_queue(&timeout_queue);
 }
 
+static void dispatch(qnode *qn) {
+    if (qn->action == QUEUE_NOTIFY) {
+        /* fresh notification! */
+        do_notify(qn, 0);
+    } else if (qn->action == QUEUE_CLOSE_MANY) {
+        do_close_many(qn);
+    } else if (qn->action == QUEUE_HANDOVER) {
+        do_handover(qn);
+    } else if (qn->action == QUEUE_COMPLETE) {
+        do_complete(qn);
+    } else if (qn->action == QUEUE_RESUME) {
+        do_resume(qn);
+    } else {
+        /* closed ... probably */
+        do_close(qn);
+    }
+    flush_groups();
+}
+
+#if NL_SINGLE_THREAD
+static guint dispatch_source = 0;
+
+// Runs on the main context whenever there are events queued, and handles
+// every one which is ready.  Busy IDs' events are left until their
+// completion is queued, which schedules this again.
+static gboolean dispatch_ready(gpointer p) {
+    qnode *qn;
+
+    dispatch_source = 0;
+    while (listening && (qn = next_ready()) != NULL) {
+        queue_yank(&notify_queue, qn);
+        dispatch(qn);
+    }
+
+    if (!listening)
+        free_queues();
+    return G_SOURCE_REMOVE;
+}
+#else
+// Returns only once our state has been handed over to a successor.
 extern void queue_listen(void) {
-    while (1) {
+    while (listening) {
         qnode *qn;
         LOCKED(notify_queue, {
-            while (notify_queue.start == NULL)
+            while ((qn = next_ready()) == NULL)
                 pthread_cond_wait(&nq_cond, &notify_queue.lock);
-            qn = queue_yank_first(&notify_queue);
+            queue_yank(&notify_queue, qn);
         });
 
-        if (qn->action == QUEUE_NOTIFY) {
-            /* fresh notification! */
-            do_notify(qn);
-        } else {
-            /* closed ... probably */
-            do_close(qn);
-        }
+        dispatch(qn);
     }
+
+    free_queues();
 }
+#endif
 
 
 /**
@@ -232,10 +997,11 @@ extern void queue_listen(void) {
  */
 
 static int scan_for_timeout(gpointer p) {
-    int64_t current_time = g_get_monotonic_time() / 1000;
+    int64_t current_time;
     qnode *qn, *qnext;
 
     LOCKED(timeout_queue, {
+        current_time = virtual_now();
         for (qn = timeout_queue.start; qn; qn = qnext) {
             qnext = qn->next;
             if (!qn->exp || qn->exp > current_time)
@@ -250,59 +1016,266 @@ static int scan_for_timeout(gpointer p) {
     return G_SOURCE_REMOVE;
 }
 
+/* Callers MUST lock the notify queue's mutex before calling!!
+ *
+ * Lets the callback thread know there are events queued.  In a single-
+ * threaded build, schedules them to be handled on the main context instead,
+ * once whatever is running now returns to it. */
+static void wake(void) {
+#if NL_SINGLE_THREAD
+    if (dispatch_source == 0 && listening) {
+        GSource *src = g_idle_source_new();
+        g_source_set_priority(src, G_PRIORITY_DEFAULT);
+        dispatch_source = add_source(src, dispatch_ready);
+    }
+#else
+    pthread_cond_broadcast(&nq_cond);
+#endif
+}
+
+/* Callers MUST lock the notify queue's mutex before calling!!
+ *
+ * Queues an event, or holds it if it's a new note and we're paused. */
+static void queue_event(qnode *qn) {
+    if (holding && qn->action == QUEUE_NOTIFY)
+        queue_insert(&hold_queue, qn);
+    else
+        queue_insert(&notify_queue, qn);
+}
+
 static void enqueue(qnode *qn, int action) {
     qn->action = action;
+    qn->queued = g_get_monotonic_time();
 
     LOCKED(notify_queue, {
-        queue_insert(&notify_queue, qn);
-        pthread_cond_broadcast(&nq_cond);
+        queue_event(qn);
+        wake();
     });
 }
 
-extern void queue_notify(NLNote *n, char *tag) {
-    qnode *qn = ealloc(sizeof(qnode));
+static qnode *new_notify_qn(NLNote *n, char *tag) {
+    qnode *qn = new_qn(n->id, QUEUE_NOTIFY);
     qn->n = n;
-    qn->id = n->id;
-    qn->exp = 0;
 #if NL_TAGS
     qn->tag = tag;
 #endif
-    enqueue(qn, QUEUE_NOTIFY);
+    return qn;
+}
+
+extern void queue_notify(NLNote *n, char *tag) {
+    enqueue(new_notify_qn(n, tag), QUEUE_NOTIFY);
+}
+
+// Queues many notes under a single lock acquisition and wakeup.
+extern void queue_notify_batch(NLNote **ns, char **tags, size_t count) {
+    if (count == 0)
+        return;
+
+    qnode **qns = ealloc(sizeof(qnode *) * count);
+    int64_t now = g_get_monotonic_time();
+    size_t i;
+    for (i = 0; i < count; i++) {
+        qns[i] = new_notify_qn(ns[i], tags[i]);
+        qns[i]->queued = now;
+    }
+
+    LOCKED(notify_queue, {
+        for (i = 0; i < count; i++)
+            queue_event(qns[i]);
+        wake();
+    });
+
+    free(qns);
 }
 
 extern void queue_close(uint32_t id, enum CloseReason reason) {
-    qnode *qn = ealloc(sizeof(qnode));
-    qn->n = NULL;
-    qn->id = id;
-    qn->exp = 0;
-    qn->tag = NULL;
-    enqueue(qn, reason);
+    enqueue(new_qn(id, reason), reason);
+}
+
+static void enqueue_close_many(close_many *m) {
+    qnode *qn = new_qn(0, QUEUE_CLOSE_MANY);
+    qn->many = m;
+    enqueue(qn, QUEUE_CLOSE_MANY);
+}
+
+static close_many *new_close_many(enum CloseReason reason) {
+    close_many *m = ealloc(sizeof(close_many));
+    m->reason = reason;
+    m->ids = NULL;
+    m->appname = NULL;
+    return m;
+}
+
+extern void queue_close_ids(const uint32_t *ids, size_t count, enum CloseReason reason) {
+    if (count == 0)
+        return;
+
+    close_many *m = new_close_many(reason);
+    m->ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    size_t i;
+    for (i = 0; i < count; i++)
+        g_hash_table_add(m->ids, GUINT_TO_POINTER(ids[i]));
+    enqueue_close_many(m);
+}
+
+extern void queue_close_app(const char *appname, enum CloseReason reason) {
+    close_many *m = new_close_many(reason);
+    m->appname = intern_ref(appname ? appname : "");
+    enqueue_close_many(m);
+}
+
+extern void queue_close_all(enum CloseReason reason) {
+    enqueue_close_many(new_close_many(reason));
+}
+
+// May be called from any thread (but see NL_SINGLE_THREAD), including from
+// within the async callback.
+extern void nl_complete(NLCompletion c) {
+    qnode *qn = new_qn(c.id, QUEUE_COMPLETE);
+    qn->serial = c.serial;
+    enqueue(qn, QUEUE_COMPLETE);
+}
+
+extern void nl_set_pause_collapse(int on) {
+    collapse = on;
+}
+
+extern void nl_pause(void) {
+    qnode *qn, *qnext;
+
+    LOCKED(timeout_queue, {
+        if (paused_at == 0)
+            paused_at = g_get_monotonic_time() / 1000;
+    });
+    // Notes queued but not yet opened are held too.
+    LOCKED(notify_queue, {
+        if (!holding) {
+            for (qn = notify_queue.start; qn; qn = qnext) {
+                qnext = qn->next;
+                if (qn->action == QUEUE_NOTIFY) {
+                    queue_yank(&notify_queue, qn);
+                    queue_insert(&hold_queue, qn);
+                }
+            }
+            holding = 1;
+        }
+    });
+}
+
+// Restarts the clock, and queues the release of the notes held meanwhile.
+// Expiry timers which went off while paused found nothing due, so each note
+// with an expiry gets a fresh one.
+extern void nl_resume(void) {
+    qnode *qn;
+    int was_paused = 0;
+
+    LOCKED(timeout_queue, {
+        if (paused_at != 0) {
+            was_paused = 1;
+            time_paused += g_get_monotonic_time() / 1000 - paused_at;
+            paused_at = 0;
+
+            int64_t now = virtual_now();
+            for (qn = timeout_queue.start; qn; qn = qn->next) {
+                if (qn->exp != 0)
+                    add_source(g_timeout_source_new(qn->exp > now ? qn->exp - now : 0),
+                               scan_for_timeout);
+            }
+        }
+    });
+
+    if (was_paused)
+        enqueue(new_qn(0, QUEUE_RESUME), QUEUE_RESUME);
+}
+
+// Queues the handover behind everything the D-Bus thread has queued so far.
+extern void queue_handover(void) {
+    enqueue(new_qn(0, QUEUE_HANDOVER), QUEUE_HANDOVER);
+}
+
+// A note's signals only go to its sender while no other client has its ID.
+static void share_with(const NLNote *n, const char *sender) {
+    if (n->sender != NULL && g_strcmp0(n->sender, sender) != 0)
+        note_share(n);
+}
+
+// Pushes back the expiry of an open (or about-to-open) note as though it had
+// just been opened.  Returns false if there is no such note, or if the note is
+// about to be closed.
+extern int queue_refresh(uint32_t id, const char *sender) {
+    qnode *qn;
+    int found = 0;
+    int32_t timeout_ms = 0;
+
+    LOCKED(notify_queue, {
+        qn = queue_find_id(&notify_queue, id);
+        if (qn == NULL)
+            qn = queue_find_id(&hold_queue, id);
+        if (qn != NULL)
+            found = (qn->action == QUEUE_NOTIFY) ? 1 : -1;
+        if (found > 0)
+            share_with(qn->n, sender);
+    });
+    if (found)
+        return found > 0;
+
+    LOCKED(timeout_queue, {
+        qn = queue_find_id(&timeout_queue, id);
+        if (qn != NULL) {
+            found = 1;
+            share_with(qn->n, sender);
+            // A note still being shown will start its expiry afresh anyway.
+            timeout_ms = qn->serial == 0 ? note_timeout(qn->n) : 0;
+            if (timeout_ms != 0)
+                qn->exp = virtual_now() + timeout_ms;
+        }
+    });
+
+    if (timeout_ms != 0)
+        add_source(g_timeout_source_new(timeout_ms), scan_for_timeout);
+    return found;
+}
+
+// How many events are waiting for the callback thread, and when the oldest
+// was queued.
+extern size_t queue_stats(int64_t *oldest) {
+    size_t depth = 0;
+    qnode *qn;
+
+    LOCKED(notify_queue, {
+        // Notes held while paused aren't waiting on the callback thread.
+        *oldest = 0;
+        for (qn = notify_queue.start; qn; qn = qn->next) {
+            if (depth++ == 0)
+                *oldest = qn->queued;
+        }
+    });
+    return depth;
 }
 
 extern int queue_call(uint32_t id, int (*callback)(const NLNote *, void *), void *data) {
     qnode *qn = NULL;
-    pthread_mutex_t *m = NULL;
+    queue *q = &notify_queue;
 
-    pthread_mutex_lock(&notify_queue.lock);
+    QUEUE_LOCK(notify_queue);
     qn = queue_find_id(&notify_queue, id);
-    if (qn != NULL) {
-        m = &notify_queue.lock;
-    } else {
-        pthread_mutex_unlock(&notify_queue.lock);
+    if (qn == NULL)
+        qn = queue_find_id(&hold_queue, id);
+    if (qn == NULL) {
+        QUEUE_UNLOCK(notify_queue);
 
-        pthread_mutex_lock(&timeout_queue.lock);
+        q = &timeout_queue;
+        QUEUE_LOCK(timeout_queue);
         qn = queue_find_id(&timeout_queue, id);
-        if (qn != NULL) {
-            m = &timeout_queue.lock;
-        } else {
-            pthread_mutex_unlock(&timeout_queue.lock);
-        }
+        if (qn == NULL)
+            QUEUE_UNLOCK(timeout_queue);
     }
 
     int result;
     if (qn != NULL) {
         result = callback(qn->n, data);
-        pthread_mutex_unlock(m);
+        QUEUE_UNLOCK(*q);
     } else {
         result = callback(NULL, data);
     }
@@ -314,7 +1287,8 @@ extern int tag_to_id(char *tag) {
     qnode *n;
     int id = 0;
     LOCKED(notify_queue, {
-        if ((n = queue_find_tag(&notify_queue, tag)))
+        if ((n = queue_find_tag(&notify_queue, tag))
+                || (n = queue_find_tag(&hold_queue, tag)))
             id = n->id;
     });
     if (id == 0)
@@ -0,0 +1,343 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Rules, which drop or adjust notifications before they are decoded.
+ *
+ * Rules are compiled once, by nl_set_rules.  App name and category patterns
+ * go into a trie apiece, whose nodes hold the set of rules whose pattern ends
+ * there, so one walk down each trie narrows every rule down to the handful
+ * which could match.  Only those have their urgency and (precompiled) regular
+ * expressions checked.
+ *
+ * Everything here runs on the D-Bus thread, and rules are never changed once
+ * notlib is running.
+ */
+
+#include <stdint.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+typedef uint64_t word;
+#define WORD_BITS 64
+
+typedef struct trie {
+    char c;
+    struct trie *child;     /* first child */
+    struct trie *sibling;
+    word *exact;            /* rules whose pattern ends here, or NULL */
+    word *prefix;           /* rules whose pattern, less its '*', ends here */
+} trie;
+
+typedef struct {
+    GRegex *summary;
+    GRegex *body;
+    unsigned int urgencies;
+    enum NLRuleAction action;
+    int value;
+    char *tag;
+} rule;
+
+static rule *rules = NULL;
+static size_t nrules = 0;
+static size_t nwords = 0;
+
+static trie *apps = NULL;
+static trie *categories = NULL;
+static word *any_app = NULL;        /* rules with no app name pattern */
+static word *any_category = NULL;   /* rules with no category pattern */
+static word *scratch = NULL;
+static word *scratch_cats = NULL;
+
+static word *new_set(void) {
+    word *s = ealloc(sizeof(word) * nwords);
+    memset(s, 0, sizeof(word) * nwords);
+    return s;
+}
+
+static void set_add(word *s, size_t i) {
+    s[i / WORD_BITS] |= (word)1 << (i % WORD_BITS);
+}
+
+static void set_or(word *into, const word *s) {
+    size_t i;
+    for (i = 0; i < nwords; i++)
+        into[i] |= s[i];
+}
+
+static void set_and(word *into, const word *s) {
+    size_t i;
+    for (i = 0; i < nwords; i++)
+        into[i] &= s[i];
+}
+
+static trie *new_trie(char c) {
+    trie *t = ealloc(sizeof(trie));
+    t->c = c;
+    t->child = NULL;
+    t->sibling = NULL;
+    t->exact = NULL;
+    t->prefix = NULL;
+    return t;
+}
+
+static void free_trie(trie *t) {
+    while (t != NULL) {
+        trie *next = t->sibling;
+        free_trie(t->child);
+        free(t->exact);
+        free(t->prefix);
+        free(t);
+        t = next;
+    }
+}
+
+// Adds rule i's pattern to the trie.  A pattern ending in '*' matches any
+// string it is a prefix of; any other pattern matches only itself.
+static void trie_add(trie *root, const char *pattern, size_t i) {
+    size_t len = strlen(pattern);
+    int is_prefix = len > 0 && pattern[len - 1] == '*';
+    if (is_prefix)
+        len--;
+
+    trie *t = root;
+    size_t k;
+    for (k = 0; k < len; k++) {
+        trie *c;
+        for (c = t->child; c != NULL && c->c != pattern[k]; c = c->sibling)
+            ;
+        if (c == NULL) {
+            c = new_trie(pattern[k]);
+            c->sibling = t->child;
+            t->child = c;
+        }
+        t = c;
+    }
+
+    word **set = is_prefix ? &t->prefix : &t->exact;
+    if (*set == NULL)
+        *set = new_set();
+    set_add(*set, i);
+}
+
+// Adds every rule whose pattern matches s to out.
+static void trie_match(const trie *t, const char *s, word *out) {
+    while (1) {
+        if (t->prefix != NULL)
+            set_or(out, t->prefix);
+        if (*s == '\0') {
+            if (t->exact != NULL)
+                set_or(out, t->exact);
+            return;
+        }
+
+        const trie *c;
+        for (c = t->child; c != NULL && c->c != *s; c = c->sibling)
+            ;
+        if (c == NULL)
+            return;
+        t = c;
+        s++;
+    }
+}
+
+static void clear_rules(void) {
+    size_t i;
+    for (i = 0; i < nrules; i++) {
+        if (rules[i].summary != NULL)
+            g_regex_unref(rules[i].summary);
+        if (rules[i].body != NULL)
+            g_regex_unref(rules[i].body);
+        g_free(rules[i].tag);
+    }
+    free(rules);
+    free_trie(apps);
+    free_trie(categories);
+    free(any_app);
+    free(any_category);
+    free(scratch);
+    free(scratch_cats);
+
+    rules = NULL;
+    nrules = nwords = 0;
+    apps = categories = NULL;
+    any_app = any_category = scratch = scratch_cats = NULL;
+}
+
+static GRegex *compile(const char *pattern, size_t i) {
+    GError *err = NULL;
+    if (pattern == NULL)
+        return NULL;
+
+    GRegex *re = g_regex_new(pattern, G_REGEX_OPTIMIZE, 0, &err);
+    if (re == NULL) {
+        g_printerr("Rule %zu: bad pattern '%s': %s\n", i, pattern, err->message);
+        g_error_free(err);
+    }
+    return re;
+}
+
+extern int nl_set_rules(const NLRule *in, size_t count) {
+    size_t i;
+
+    clear_rules();
+    if (count == 0)
+        return 1;
+
+    nrules = count;
+    nwords = (count + WORD_BITS - 1) / WORD_BITS;
+    rules = ealloc(sizeof(rule) * count);
+    apps = new_trie('\0');
+    categories = new_trie('\0');
+    any_app = new_set();
+    any_category = new_set();
+    scratch = new_set();
+    scratch_cats = new_set();
+
+    for (i = 0; i < count; i++) {
+        rule *r = &rules[i];
+        r->summary = NULL;
+        r->body    = NULL;
+        r->urgencies = in[i].urgencies;
+        r->action  = in[i].action;
+        r->value   = in[i].value;
+        r->tag     = g_strdup(in[i].tag);
+
+        if (in[i].appname != NULL)
+            trie_add(apps, in[i].appname, i);
+        else
+            set_add(any_app, i);
+
+        if (in[i].category != NULL)
+            trie_add(categories, in[i].category, i);
+        else
+            set_add(any_category, i);
+
+        r->summary = compile(in[i].summary, i);
+        r->body    = compile(in[i].body, i);
+        if ((in[i].summary != NULL && r->summary == NULL)
+                || (in[i].body != NULL && r->body == NULL))
+            goto fail;
+
+#if !NL_URGENCY
+        if (r->action == RULE_SET_URGENCY) {
+            g_printerr("Rule %zu: RULE_SET_URGENCY needs NL_URGENCY\n", i);
+            goto fail;
+        }
+#endif
+#if !NL_TAGS
+        if (r->action == RULE_SET_TAG) {
+            g_printerr("Rule %zu: RULE_SET_TAG needs NL_TAGS\n", i);
+            goto fail;
+        }
+#endif
+    }
+    return 1;
+
+fail:
+    // Leave the later rules' fields in a state clear_rules can handle.
+    for (i++; i < count; i++) {
+        rules[i].summary = rules[i].body = NULL;
+        rules[i].tag = NULL;
+    }
+    clear_rules();
+    return 0;
+}
+
+extern int rules_enabled(void) {
+    return nrules > 0;
+}
+
+static int regex_matches(const GRegex *re, const char *s) {
+    return re == NULL || g_regex_match(re, s, 0, NULL);
+}
+
+// Runs the rules against the arguments to a Notify call.  Returns true if
+// the notification should be dropped; otherwise, fills in res with what
+// should be changed.
+extern int rules_match(GVariant *params, rule_result *res) {
+    const char *appname, *summary, *body;
+    const char *category = NULL;
+    int urgency = 1;
+    size_t w;
+    GVariant *cat_v, *urg_v;
+
+    res->timeout = -1;
+    res->urgency = -1;
+    res->tag = NULL;
+
+    g_variant_get_child(params, 0, "&s", &appname);
+    g_variant_get_child(params, 3, "&s", &summary);
+    g_variant_get_child(params, 4, "&s", &body);
+
+    GVariant *hints = g_variant_get_child_value(params, 6);
+    if ((cat_v = g_variant_lookup_value(hints, "category", G_VARIANT_TYPE_STRING)))
+        category = g_variant_get_string(cat_v, NULL);
+    if ((urg_v = g_variant_lookup_value(hints, "urgency", G_VARIANT_TYPE_BYTE)))
+        urgency = g_variant_get_byte(urg_v);
+
+    memcpy(scratch, any_app, sizeof(word) * nwords);
+    trie_match(apps, appname, scratch);
+    if (category != NULL) {
+        memcpy(scratch_cats, any_category, sizeof(word) * nwords);
+        trie_match(categories, category, scratch_cats);
+        set_and(scratch, scratch_cats);
+    } else {
+        set_and(scratch, any_category);
+    }
+
+    int drop = 0;
+    for (w = 0; w < nwords && !drop; w++) {
+        word bits = scratch[w];
+        while (bits != 0 && !drop) {
+            size_t i = w * WORD_BITS + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            const rule *r = &rules[i];
+            if (r->urgencies != 0
+                    && (urgency < 0 || urgency > 31 || !(r->urgencies & (1u << urgency))))
+                continue;
+            if (!regex_matches(r->summary, summary) || !regex_matches(r->body, body))
+                continue;
+
+            switch (r->action) {
+            case RULE_DROP:
+                drop = 1;
+                break;
+            case RULE_SET_TIMEOUT:
+                res->timeout = r->value;
+                break;
+            case RULE_SET_URGENCY:
+                res->urgency = urgency = r->value;
+                break;
+            case RULE_SET_TAG:
+                res->tag = r->tag;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+
+    if (cat_v != NULL)
+        g_variant_unref(cat_v);
+    if (urg_v != NULL)
+        g_variant_unref(urg_v);
+    g_variant_unref(hints);
+    return drop;
+}
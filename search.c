@@ -0,0 +1,289 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * An inverted index of the words in open notes' app names, summaries and
+ * bodies, and in closed notes' too while they remain in the history.
+ *
+ * A word is a run of letters and digits, lowercased.  Each word maps to the
+ * set of IDs of notes containing it, and each note keeps its list of words,
+ * so that it can be taken back out.  Words are kept sorted, so that those
+ * starting with a prefix can be found without looking at the rest.  The
+ * index is updated on the callback thread as notes open and close, and
+ * searched from any thread.
+ *
+ * Results are ordered by when each note was last indexed, newest first,
+ * rather than by ID, since IDs wrap and may be reused.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#if NL_SEARCH
+
+typedef struct {
+    char **words;   /* distinct, NULL-terminated */
+    uint64_t seq;   /* when it was indexed, in order */
+    int open;
+} doc;
+
+typedef struct {
+    uint32_t id;
+    uint64_t seq;
+} hit;
+
+static pthread_mutex_t search_lock = PTHREAD_MUTEX_INITIALIZER;
+static GTree *by_word = NULL;       /* word -> set of IDs */
+static GHashTable *docs = NULL;     /* ID -> doc */
+static uint64_t last_seq = 0;
+
+static void free_doc(gpointer p) {
+    doc *d = p;
+    g_strfreev(d->words);
+    free(d);
+}
+
+static gint compare_words(gconstpointer a, gconstpointer b, gpointer data) {
+    return strcmp(a, b);
+}
+
+static void init(void) {
+    if (by_word != NULL)
+        return;
+    by_word = g_tree_new_full(compare_words, NULL, g_free,
+                              (GDestroyNotify)g_hash_table_unref);
+    docs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free_doc);
+}
+
+// Calls fn on each word of s, lowercased.
+static void each_word(const char *s, void (*fn)(const char *, void *), void *data) {
+    GString *word = g_string_new(NULL);
+
+    if (s == NULL)
+        s = "";
+    while (1) {
+        gunichar c = g_utf8_get_char(s);
+        if (c != 0 && g_unichar_isalnum(c)) {
+            g_string_append_unichar(word, g_unichar_tolower(c));
+        } else if (word->len > 0) {
+            fn(word->str, data);
+            g_string_truncate(word, 0);
+        }
+        if (c == 0)
+            break;
+        s = g_utf8_next_char(s);
+    }
+    g_string_free(word, TRUE);
+}
+
+static void add_to_set(const char *word, void *set) {
+    if (!g_hash_table_contains(set, word))
+        g_hash_table_add(set, g_strdup(word));
+}
+
+static void add_to_array(const char *word, void *array) {
+    g_ptr_array_add(array, g_strdup(word));
+}
+
+static char **words_of(GHashTable *set) {
+    char **words = ealloc(sizeof(char *) * (g_hash_table_size(set) + 1));
+    GHashTableIter iter;
+    gpointer key;
+    size_t i = 0;
+
+    g_hash_table_iter_init(&iter, set);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        words[i++] = key;
+        g_hash_table_iter_steal(&iter);
+    }
+    words[i] = NULL;
+    return words;
+}
+
+/* Callers MUST hold search_lock!! */
+static void unindex(uint32_t id) {
+    doc *d = g_hash_table_lookup(docs, GUINT_TO_POINTER(id));
+    char **w;
+    if (d == NULL)
+        return;
+
+    for (w = d->words; *w != NULL; w++) {
+        GHashTable *ids = g_tree_lookup(by_word, *w);
+        if (ids == NULL)
+            continue;
+        g_hash_table_remove(ids, GUINT_TO_POINTER(id));
+        if (g_hash_table_size(ids) == 0)
+            g_tree_remove(by_word, *w);
+    }
+    g_hash_table_remove(docs, GUINT_TO_POINTER(id));
+}
+
+// Indexes a note which has just opened, replacing whatever was indexed under
+// its ID before.
+extern void search_add(const NLNote *n) {
+    GHashTable *set = g_hash_table_new(g_str_hash, g_str_equal);
+    each_word(n->appname, add_to_set, set);
+    each_word(n->summary, add_to_set, set);
+    each_word(n->body, add_to_set, set);
+
+    doc *d = ealloc(sizeof(doc));
+    d->words = words_of(set);
+    d->open = 1;
+    g_hash_table_unref(set);
+
+    pthread_mutex_lock(&search_lock);
+    init();
+    unindex(n->id);
+    d->seq = ++last_seq;
+
+    char **w;
+    for (w = d->words; *w != NULL; w++) {
+        GHashTable *ids = g_tree_lookup(by_word, *w);
+        if (ids == NULL) {
+            ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+            g_tree_insert(by_word, g_strdup(*w), ids);
+        }
+        g_hash_table_add(ids, GUINT_TO_POINTER(n->id));
+    }
+    g_hash_table_insert(docs, GUINT_TO_POINTER(n->id), d);
+    pthread_mutex_unlock(&search_lock);
+}
+
+// A note has closed.  If the history kept it, so does the index, until the
+// history lets it go.
+extern void search_close(uint32_t id, int kept) {
+    pthread_mutex_lock(&search_lock);
+    if (docs != NULL) {
+        if (kept) {
+            doc *d = g_hash_table_lookup(docs, GUINT_TO_POINTER(id));
+            if (d != NULL)
+                d->open = 0;
+        } else {
+            unindex(id);
+        }
+    }
+    pthread_mutex_unlock(&search_lock);
+}
+
+// Called as notes fall out of the history.  The same ID may have been opened
+// again since, in which case it stays.
+extern void search_forget(uint32_t id) {
+    pthread_mutex_lock(&search_lock);
+    if (docs != NULL) {
+        doc *d = g_hash_table_lookup(docs, GUINT_TO_POINTER(id));
+        if (d != NULL && !d->open)
+            unindex(id);
+    }
+    pthread_mutex_unlock(&search_lock);
+}
+
+static gint newest_first(gconstpointer a, gconstpointer b) {
+    uint64_t x = ((const hit *)a)->seq, y = ((const hit *)b)->seq;
+    return (x < y) - (x > y);
+}
+
+// Adds to out the IDs of notes with a word starting with prefix.  Those words
+// sort together, from the first at or after the prefix itself.
+static void match_prefix(const char *prefix, GHashTable *out) {
+    GTreeNode *node;
+    GHashTableIter ids;
+    gpointer id;
+
+    for (node = g_tree_lower_bound(by_word, prefix);
+            node != NULL && g_str_has_prefix(g_tree_node_key(node), prefix);
+            node = g_tree_node_next(node)) {
+        g_hash_table_iter_init(&ids, g_tree_node_value(node));
+        while (g_hash_table_iter_next(&ids, &id, NULL))
+            g_hash_table_add(out, id);
+    }
+}
+
+extern size_t nl_search(const char *query, unsigned int *out, size_t max) {
+    if (query == NULL || !g_utf8_validate(query, -1, NULL))
+        return 0;
+
+    // The words of the query, in order; the last is matched as a prefix,
+    // since it may still be being typed.
+    GPtrArray *words = g_ptr_array_new_with_free_func(g_free);
+    each_word(query, add_to_array, words);
+
+    size_t found = 0;
+    if (words->len == 0)
+        goto out;
+
+    pthread_mutex_lock(&search_lock);
+    if (by_word == NULL) {
+        pthread_mutex_unlock(&search_lock);
+        goto out;
+    }
+
+    GHashTable *last = g_hash_table_new(g_direct_hash, g_direct_equal);
+    match_prefix(g_ptr_array_index(words, words->len - 1), last);
+
+    // Start from the smallest set, and check each of its IDs against the
+    // others.
+    GHashTable **sets = ealloc(sizeof(GHashTable *) * words->len);
+    GHashTable *smallest = last;
+    size_t i, nsets = 0;
+    for (i = 0; i + 1 < words->len; i++) {
+        GHashTable *ids = g_tree_lookup(by_word, g_ptr_array_index(words, i));
+        if (ids == NULL) {
+            smallest = NULL;
+            break;
+        }
+        sets[nsets++] = ids;
+        if (g_hash_table_size(ids) < g_hash_table_size(smallest))
+            smallest = ids;
+    }
+    sets[nsets++] = last;
+
+    GArray *hits = g_array_new(FALSE, FALSE, sizeof(hit));
+    if (smallest != NULL) {
+        GHashTableIter iter;
+        gpointer id;
+        g_hash_table_iter_init(&iter, smallest);
+        while (g_hash_table_iter_next(&iter, &id, NULL)) {
+            for (i = 0; i < nsets; i++) {
+                if (sets[i] != smallest && !g_hash_table_contains(sets[i], id))
+                    break;
+            }
+            if (i == nsets) {
+                const doc *d = g_hash_table_lookup(docs, id);
+                hit h = { GPOINTER_TO_UINT(id), d->seq };
+                g_array_append_val(hits, h);
+            }
+        }
+    }
+    pthread_mutex_unlock(&search_lock);
+
+    g_array_sort(hits, newest_first);
+    for (found = 0; found < hits->len && found < max; found++)
+        out[found] = g_array_index(hits, hit, found).id;
+
+    g_array_free(hits, TRUE);
+    free(sets);
+    g_hash_table_unref(last);
+out:
+    g_ptr_array_unref(words);
+    return found;
+}
+
+#endif
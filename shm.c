@@ -0,0 +1,262 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Publishing of open notes to shared memory, for other processes to read
+ * without asking over D-Bus.  The layout is described in notlib_shm.h.
+ *
+ * Everything here runs on the callback thread, which is the region's only
+ * writer, except shm_start.  The object is reused, rather than unlinked and
+ * recreated, across restarts, so readers never need to map it again.  When
+ * taking over from a predecessor (see handover.c), the region isn't touched
+ * until the predecessor has handed over, and stopped writing to it, so that
+ * there is never more than one writer.
+ *
+ * The region holds every open note's contents, so it is only ever created
+ * readable by our own user, and one created by anyone else is refused.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "notlib.h"
+#include "notlib_shm.h"
+#include "_notlib_internal.h"
+
+/* Share of the region given to the entry table; strings get the rest. */
+#define ENTRY_SHARE 4
+
+static const char *shm_name = NULL;
+static size_t shm_size = 0;
+static int shm_fd = -1;             /* until the region is taken over */
+static int ready = 0;               /* set once it has been */
+static NLShmHeader *hdr = NULL;
+static GHashTable *by_id = NULL;    /* ID -> index + 1 of its live entry */
+
+static NLShmNote *entry(uint32_t i) {
+    return (NLShmNote *)((char *)hdr + hdr->entries_off) + i;
+}
+
+static char *strings(void) {
+    return (char *)hdr + hdr->strings_off;
+}
+
+static void write_begin(void) {
+    __atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(void) {
+    __atomic_store_n(&hdr->seq, hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+extern int nl_set_shm_export(const char *name, size_t size) {
+    struct stat st;
+    int fd;
+
+    if (size < sizeof(NLShmHeader) + ENTRY_SHARE * sizeof(NLShmNote)) {
+        fprintf(stderr, "Shared memory region of %zu bytes is too small\n", size);
+        return 0;
+    }
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0 || fstat(fd, &st) < 0) {
+        perror(name);
+        if (fd >= 0)
+            close(fd);
+        return 0;
+    }
+    if (st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "Shared memory object %s is not private to this user\n", name);
+        close(fd);
+        return 0;
+    }
+
+    if (shm_fd >= 0)
+        close(shm_fd);
+    shm_name = name;
+    shm_size = size;
+    shm_fd = fd;
+    return 1;
+}
+
+// Takes the region over, once any predecessor has finished with it.  Called
+// on the D-Bus thread, before any note can open.
+extern void shm_start(void) {
+    size_t size = shm_size;
+    size_t table;
+    void *p;
+
+    if (shm_fd < 0)
+        return;
+
+    // Only now is the size changed, since a predecessor may have had the
+    // object mapped at another size.
+    if (ftruncate(shm_fd, size) < 0
+            || (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                         shm_fd, 0)) == MAP_FAILED) {
+        perror(shm_name);
+        close(shm_fd);
+        shm_fd = -1;
+        return;
+    }
+    close(shm_fd);
+    shm_fd = -1;
+
+    // A predecessor's seq, if any, carries on, so that readers part way
+    // through a read notice the region has changed under them.  If it died
+    // part way through a write, seq is left odd; it is made even again before
+    // the first write, so that readers don't wait forever.
+    hdr = p;
+    uint64_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->seq, (seq + 1) & ~(uint64_t)1, __ATOMIC_RELAXED);
+    write_begin();
+    table = (size - sizeof(NLShmHeader)) / ENTRY_SHARE;
+    hdr->magic = NLSHM_MAGIC;
+    hdr->version = NLSHM_VERSION;
+    hdr->size = size;
+    hdr->generation++;
+    hdr->entries_off = sizeof(NLShmHeader);
+    hdr->max_entries = table / sizeof(NLShmNote);
+    hdr->nentries = 0;
+    hdr->live = 0;
+    hdr->dropped = 0;
+    hdr->strings_off = hdr->entries_off + (uint64_t)hdr->max_entries * sizeof(NLShmNote);
+    hdr->strings_size = size - 1 - hdr->strings_off;
+    hdr->strings_used = 0;
+    ((char *)hdr)[size - 1] = '\0';
+    write_end();
+
+    by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+    __atomic_store_n(&ready, 1, __ATOMIC_RELEASE);
+}
+
+// Stops writing to the region, before handing over to a successor.
+extern void shm_stop(void) {
+    __atomic_store_n(&ready, 0, __ATOMIC_RELEASE);
+}
+
+extern int shm_enabled(void) {
+    return __atomic_load_n(&ready, __ATOMIC_ACQUIRE);
+}
+
+// Moves the live entries, and their strings, to the front.
+// Callers MUST be inside write_begin/write_end!!
+static void compact(void) {
+    char *old = ealloc(hdr->strings_used + 1);
+    uint32_t i, n = 0;
+    uint64_t used = 0;
+
+    memcpy(old, strings(), hdr->strings_used);
+    g_hash_table_remove_all(by_id);
+
+    for (i = 0; i < hdr->nentries; i++) {
+        NLShmNote e = *entry(i);
+        if (!(e.flags & NLSHM_LIVE))
+            continue;
+
+        uint32_t *fields[] = { &e.appname, &e.summary, &e.body };
+        size_t f;
+        for (f = 0; f < G_N_ELEMENTS(fields); f++) {
+            const char *s = old + *fields[f];
+            size_t len = strlen(s) + 1;
+            memcpy(strings() + used, s, len);
+            *fields[f] = used;
+            used += len;
+        }
+
+        *entry(n) = e;
+        g_hash_table_insert(by_id, GUINT_TO_POINTER(e.id), GUINT_TO_POINTER(n + 1));
+        n++;
+    }
+
+    hdr->nentries = n;
+    hdr->strings_used = used;
+    hdr->generation++;
+    free(old);
+}
+
+static uint32_t put_string(const char *s) {
+    size_t len = strlen(s ? s : "") + 1;
+    uint32_t off = hdr->strings_used;
+    memcpy(strings() + off, s ? s : "", len);
+    hdr->strings_used += len;
+    return off;
+}
+
+static void unpublish(uint32_t id) {
+    gpointer i = g_hash_table_lookup(by_id, GUINT_TO_POINTER(id));
+    if (i == NULL)
+        return;
+    entry(GPOINTER_TO_UINT(i) - 1)->flags &= ~NLSHM_LIVE;
+    hdr->live--;
+    g_hash_table_remove(by_id, GUINT_TO_POINTER(id));
+}
+
+// Publishes a note which has just opened, in place of any note it replaces.
+extern void shm_add(const NLNote *n, int64_t opened) {
+    size_t need = strlen(n->appname) + strlen(n->summary ? n->summary : "")
+                + strlen(n->body ? n->body : "") + 3;
+
+    write_begin();
+    unpublish(n->id);
+
+    if (hdr->nentries == hdr->max_entries
+            || hdr->strings_used + need > hdr->strings_size)
+        compact();
+    if (hdr->nentries == hdr->max_entries
+            || hdr->strings_used + need > hdr->strings_size) {
+        hdr->dropped++;
+        write_end();
+        return;
+    }
+
+    NLShmNote *e = entry(hdr->nentries);
+    e->id = n->id;
+    e->opened = opened;
+#if NL_URGENCY
+    e->urgency = n->urgency;
+#else
+    e->urgency = -1;
+#endif
+    e->timeout = n->timeout;
+    e->appname = put_string(n->appname);
+    e->summary = put_string(n->summary);
+    e->body = put_string(n->body);
+    e->pad = 0;
+    e->flags = NLSHM_LIVE;
+
+    g_hash_table_insert(by_id, GUINT_TO_POINTER(n->id),
+                        GUINT_TO_POINTER(hdr->nentries + 1));
+    hdr->nentries++;
+    hdr->live++;
+    write_end();
+}
+
+extern void shm_remove(uint32_t id) {
+    if (!g_hash_table_contains(by_id, GUINT_TO_POINTER(id)))
+        return;
+    write_begin();
+    unpublish(id);
+    write_end();
+}
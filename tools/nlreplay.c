@@ -0,0 +1,457 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Plays a trace recorded with nl_set_capture_file back into a notlib server
+ * of its own, on a private bus, and reports how the server kept up:
+ *
+ *   nlreplay [-s SPEED] [-j THREADS] TRACE
+ *
+ * SPEED scales the gaps between calls: 1 (the default) replays in real time,
+ * 10 ten times as fast, and 0 as fast as the bus will take them.  THREADS is
+ * passed to nl_set_decode_threads.
+ *
+ * Each Notify is tagged with a sequence number hint, so that the notify
+ * callback can tell which call it came from.  IDs in the trace are mapped to
+ * the IDs the replay server hands out, so replacements and closes hit the
+ * same notes they did originally.  Results are printed as lines of JSON, like
+ * bench/microbench's:
+ *
+ *   {"replay": "backlog", "t_ms": 100, "in_flight": 12, "queued": 3}
+ *   {"replay": "throughput", "calls": 5000, "seconds": 1.02, "per_sec": 4901.9}
+ *   {"replay": "latency", "notes": 4990, "p50_us": 85, ...}
+ *
+ * where in_flight is how many notes have been sent but not yet reached the
+ * notify callback (whether on the bus, being decoded or queued), queued is
+ * how many events are waiting in notlib's queue for the callback thread, both
+ * sampled every SAMPLE_MS, and latency is from sending each Notify to its
+ * callback.
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../notlib.h"
+#include "../_notlib_internal.h"
+
+#define SEQ_HINT  "x-nlreplay-seq"
+#define SAMPLE_MS 100
+#define DRAIN_MS  5000      /* how long to wait for stragglers */
+#define START_MS  5000      /* how long to wait for the server to start */
+
+typedef struct {
+    uint64_t t;
+    uint8_t kind;
+    uint32_t id;
+    GVariant *args;
+} record;
+
+typedef struct {
+    int64_t t_ms;
+    int in_flight;
+    size_t queued;
+} sample;
+
+static GDBusConnection *conn = NULL;
+static GMainContext *ctx = NULL;
+
+static GHashTable *live_ids = NULL;     /* traced ID -> replayed ID */
+static int pending = 0;                 /* calls awaiting a reply */
+static size_t errors = 0;
+
+static int64_t *sent_at = NULL;         /* by sequence number */
+static int64_t *seen_at = NULL;
+static int nseq = 0;
+static int nsent = 0;
+static gint nseen = 0;
+
+static GArray *samples = NULL;
+
+/*
+ * The server.
+ */
+
+// Runs on notlib's callback thread.
+static void on_note(const NLNote *n) {
+    int seq;
+    if (nl_get_int_hint(n, SEQ_HINT, &seq) && seq >= 0 && seq < nseq) {
+        seen_at[seq] = g_get_monotonic_time();
+        g_atomic_int_inc(&nseen);
+    }
+}
+
+static void *run_server(void *data) {
+    static char *caps[] = { NULL };
+    static NLServerInfo info = { "nlreplay", "notlib", "0.2" };
+    NLNoteCallbacks cbs = { .notify = on_note, .replace = on_note };
+
+    notlib_run(cbs, caps, &info);
+    return NULL;
+}
+
+static int wait_for_server(void) {
+    int64_t give_up = g_get_monotonic_time() + START_MS * 1000;
+
+    while (g_get_monotonic_time() < give_up) {
+        GVariant *reply = g_dbus_connection_call_sync(conn,
+                "org.freedesktop.DBus", "/org/freedesktop/DBus",
+                "org.freedesktop.DBus", "NameHasOwner",
+                g_variant_new("(s)", FDN_NAME), G_VARIANT_TYPE("(b)"),
+                G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+        gboolean owned = FALSE;
+        if (reply != NULL) {
+            g_variant_get(reply, "(b)", &owned);
+            g_variant_unref(reply);
+        }
+        if (owned)
+            return 1;
+        g_usleep(10 * 1000);
+    }
+    return 0;
+}
+
+/*
+ * Reading the trace.
+ */
+
+static const GVariantType *args_type(uint8_t kind) {
+    switch (kind) {
+    case CAPTURE_NOTIFY:        return G_VARIANT_TYPE("(susssasa{sv}i)");
+    case CAPTURE_CLOSE:         return G_VARIANT_TYPE("(u)");
+    case CAPTURE_INVOKE_ACTION: return G_VARIANT_TYPE("(us)");
+    case CAPTURE_CLOSE_MANY:    return G_VARIANT_TYPE("(au)");
+    default:                    return NULL;
+    }
+}
+
+static GArray *read_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    char magic[sizeof(CAPTURE_MAGIC)];
+    uint32_t version;
+
+    if (f == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if (fread(magic, sizeof(magic), 1, f) != 1
+            || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0
+            || fread(&version, sizeof(version), 1, f) != 1
+            || version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a version %d notlib trace\n", path, CAPTURE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+
+    GArray *records = g_array_new(FALSE, FALSE, sizeof(record));
+    record r;
+    uint32_t len;
+    while (fread(&r.t, sizeof(r.t), 1, f) == 1
+            && fread(&r.kind, sizeof(r.kind), 1, f) == 1
+            && fread(&r.id, sizeof(r.id), 1, f) == 1
+            && fread(&len, sizeof(len), 1, f) == 1) {
+        const GVariantType *type = args_type(r.kind);
+        char *buf = g_malloc(len ? len : 1);
+        if (type == NULL || fread(buf, 1, len, f) != len) {
+            fprintf(stderr, "%s: truncated or corrupt after %u records\n",
+                    path, records->len);
+            g_free(buf);
+            break;
+        }
+        r.args = g_variant_ref_sink(g_variant_new_from_data(type, buf, len,
+                                                            FALSE, g_free, buf));
+        if (r.kind == CAPTURE_NOTIFY)
+            nseq++;
+        g_array_append_val(records, r);
+    }
+
+    fclose(f);
+    return records;
+}
+
+/*
+ * Sending.
+ */
+
+static void take_sample(int64_t begin) {
+    static int64_t next = 0;
+    int64_t now = g_get_monotonic_time();
+    if (now < next)
+        return;
+
+    sample s;
+    s.t_ms = (now - begin) / 1000;
+    int64_t oldest;
+    s.in_flight = nsent - g_atomic_int_get(&nseen);
+    s.queued = queue_stats(&oldest);
+    g_array_append_val(samples, s);
+    next = now + SAMPLE_MS * 1000;
+}
+
+static void on_reply(GObject *src, GAsyncResult *res, gpointer data) {
+    GError *err = NULL;
+    GVariant *reply = g_dbus_connection_call_finish(G_DBUS_CONNECTION(src), res, &err);
+
+    pending--;
+    if (reply == NULL) {
+        if (errors++ == 0)
+            fprintf(stderr, "Call failed: %s\n", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    // A Notify; remember which ID the traced one became.
+    uint32_t traced = GPOINTER_TO_UINT(data);
+    if (traced != 0 && g_variant_is_of_type(reply, G_VARIANT_TYPE("(u)"))) {
+        uint32_t id;
+        g_variant_get(reply, "(u)", &id);
+        g_hash_table_insert(live_ids, GUINT_TO_POINTER(traced), GUINT_TO_POINTER(id));
+    }
+    g_variant_unref(reply);
+}
+
+// The replayed ID for a traced one, waiting for the Notify which opened it if
+// its reply hasn't come back yet.  0 if it was opened before the trace began.
+static uint32_t live_id(uint32_t traced) {
+    if (traced == 0)
+        return 0;
+    while (!g_hash_table_contains(live_ids, GUINT_TO_POINTER(traced)) && pending > 0)
+        g_main_context_iteration(ctx, TRUE);
+    return GPOINTER_TO_UINT(g_hash_table_lookup(live_ids, GUINT_TO_POINTER(traced)));
+}
+
+static void call(const char *method, GVariant *args, uint32_t traced) {
+    pending++;
+    g_dbus_connection_call(conn, FDN_NAME, FDN_PATH, FDN_IFAC, method, args,
+                           NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                           on_reply, GUINT_TO_POINTER(traced));
+}
+
+static void send_notify(const record *r, int seq) {
+    const char *app, *icon, *summary, *body;
+    uint32_t replaces;
+    GVariant *actions, *hints;
+    int32_t timeout;
+
+    g_variant_get(r->args, "(&su&s&s&s@as@a{sv}i)", &app, &replaces, &icon,
+                  &summary, &body, &actions, &hints, &timeout);
+
+    GVariantBuilder b;
+    GVariantIter iter;
+    const char *key;
+    GVariant *value;
+    g_variant_builder_init(&b, G_VARIANT_TYPE("a{sv}"));
+    g_variant_iter_init(&iter, hints);
+    while (g_variant_iter_next(&iter, "{&sv}", &key, &value)) {
+        g_variant_builder_add(&b, "{sv}", key, value);
+        g_variant_unref(value);
+    }
+    g_variant_builder_add(&b, "{sv}", SEQ_HINT, g_variant_new_int32(seq));
+
+    GVariant *args = g_variant_new("(susss@asa{sv}i)", app, live_id(replaces),
+                                   icon, summary, body, actions, &b, timeout);
+    g_variant_unref(actions);
+    g_variant_unref(hints);
+
+    sent_at[seq] = g_get_monotonic_time();
+    nsent++;
+    call("Notify", args, r->id);
+}
+
+static void send_close_many(const record *r) {
+    GVariant *ids = g_variant_get_child_value(r->args, 0);
+    GVariantBuilder b;
+    GVariantIter iter;
+    uint32_t id;
+
+    g_variant_builder_init(&b, G_VARIANT_TYPE("au"));
+    g_variant_iter_init(&iter, ids);
+    while (g_variant_iter_next(&iter, "u", &id))
+        g_variant_builder_add(&b, "u", live_id(id));
+    g_variant_unref(ids);
+
+    call("CloseNotifications", g_variant_new("(au)", &b), 0);
+}
+
+static void send_record(const record *r, int *seq) {
+    const char *key;
+
+    switch (r->kind) {
+    case CAPTURE_NOTIFY:
+        send_notify(r, (*seq)++);
+        break;
+    case CAPTURE_CLOSE:
+        call("CloseNotification", g_variant_new("(u)", live_id(r->id)), 0);
+        break;
+    case CAPTURE_INVOKE_ACTION:
+        g_variant_get_child(r->args, 1, "&s", &key);
+        call("InvokeAction", g_variant_new("(us)", live_id(r->id), key), 0);
+        break;
+    case CAPTURE_CLOSE_MANY:
+        send_close_many(r);
+        break;
+    }
+}
+
+// Handles replies until the deadline, sampling all the while.
+static void wait_until(int64_t deadline, int64_t begin) {
+    int64_t now;
+    while ((now = g_get_monotonic_time()) < deadline) {
+        take_sample(begin);
+        if (!g_main_context_iteration(ctx, FALSE))
+            g_usleep(MIN(deadline - now, 1000));
+    }
+}
+
+/*
+ * Reporting.
+ */
+
+static int cmp_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(size_t ncalls, int64_t begin, int64_t end) {
+    size_t i;
+    for (i = 0; i < samples->len; i++) {
+        sample *s = &g_array_index(samples, sample, i);
+        printf("{\"replay\": \"backlog\", \"t_ms\": %" G_GINT64_FORMAT
+               ", \"in_flight\": %d, \"queued\": %zu}\n",
+               s->t_ms, s->in_flight, s->queued);
+    }
+
+    double seconds = (end - begin) / 1e6;
+    printf("{\"replay\": \"throughput\", \"calls\": %zu, \"seconds\": %.3f, "
+           "\"per_sec\": %.1f, \"errors\": %zu}\n",
+           ncalls, seconds, seconds > 0 ? ncalls / seconds : 0.0, errors);
+
+    int64_t *lat = malloc(sizeof(int64_t) * (nseq + 1));
+    size_t n = 0;
+    for (i = 0; i < (size_t)nseq; i++) {
+        if (sent_at[i] != 0 && seen_at[i] != 0)
+            lat[n++] = seen_at[i] - sent_at[i];
+    }
+    qsort(lat, n, sizeof(int64_t), cmp_int64);
+
+    if (n > 0) {
+        printf("{\"replay\": \"latency\", \"notes\": %zu, \"p50_us\": %" G_GINT64_FORMAT
+               ", \"p90_us\": %" G_GINT64_FORMAT ", \"p99_us\": %" G_GINT64_FORMAT
+               ", \"max_us\": %" G_GINT64_FORMAT "}\n",
+               n, lat[n / 2], lat[n * 9 / 10], lat[n * 99 / 100], lat[n - 1]);
+    }
+    if ((int)n < nseq)
+        fprintf(stderr, "%d notes never reached the notify callback\n", nseq - (int)n);
+    free(lat);
+}
+
+int main(int argc, char **argv) {
+    double speed = 1;
+    int threads = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:j:")) != -1) {
+        if (opt == 's') {
+            speed = atof(optarg);
+        } else if (opt == 'j') {
+            threads = atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-s speed] [-j threads] trace\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || speed < 0 || threads < 0) {
+        fprintf(stderr, "usage: %s [-s speed] [-j threads] trace\n", argv[0]);
+        return 2;
+    }
+#if !NL_SINGLE_THREAD
+    nl_set_decode_threads(threads);
+#endif
+
+    GArray *records = read_trace(argv[optind]);
+    if (records == NULL)
+        return 1;
+    sent_at = calloc(nseq + 1, sizeof(int64_t));
+    seen_at = calloc(nseq + 1, sizeof(int64_t));
+    live_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+    samples = g_array_new(FALSE, FALSE, sizeof(sample));
+
+    // The server gets the global default context; our side of the bus gets
+    // one of its own, so that neither runs the other's sources.
+    GTestDBus *bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+    g_test_dbus_up(bus);
+
+    ctx = g_main_context_new();
+    g_main_context_push_thread_default(ctx);
+
+    GError *err = NULL;
+    conn = g_dbus_connection_new_for_address_sync(g_test_dbus_get_bus_address(bus),
+            G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT
+            | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+            NULL, NULL, &err);
+    if (conn == NULL) {
+        fprintf(stderr, "Could not connect to private bus: %s\n", err->message);
+        return 1;
+    }
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, run_server, NULL);
+    if (!wait_for_server()) {
+        fprintf(stderr, "Server did not start\n");
+        return 1;
+    }
+
+    int64_t begin = g_get_monotonic_time();
+    int seq = 0;
+    size_t i;
+    for (i = 0; i < records->len; i++) {
+        record *r = &g_array_index(records, record, i);
+        if (speed > 0)
+            wait_until(begin + (int64_t)(r->t / speed), begin);
+        send_record(r, &seq);
+        take_sample(begin);
+        while (g_main_context_iteration(ctx, FALSE))
+            ;
+    }
+
+    // Wait for the server to catch up, or to stop making progress.
+    int64_t stalled_since = g_get_monotonic_time();
+    int last = -1;
+    while (pending > 0 || g_atomic_int_get(&nseen) < nsent) {
+        int seen = g_atomic_int_get(&nseen);
+        int64_t now = g_get_monotonic_time();
+        if (seen != last) {
+            last = seen;
+            stalled_since = now;
+        } else if (now - stalled_since > DRAIN_MS * 1000) {
+            break;
+        }
+        wait_until(now + SAMPLE_MS * 1000, begin);
+    }
+    int64_t end = g_get_monotonic_time();
+
+    report(records->len, begin, end);
+
+    // notlib_run doesn't return, and the private bus is torn down when we
+    // exit, so there is nothing to clean up.
+    return 0;
+}
@@ -0,0 +1,183 @@
+/* Copyright 2023 Jack Conger */
+
+/*
+ * This file is part of notlib.
+ *
+ * notlib is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * notlib is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with notlib.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * A watchdog for stalled callbacks.
+ *
+ * The callback thread notes which callback it is in, and since when, around
+ * every call into the server.  A timer on the D-Bus thread checks that, and
+ * the age of the oldest queued event, a few times per threshold, and reports
+ * each stall once: a callback once per call, and the queue once each time it
+ * falls behind.
+ *
+ * Backtraces are taken by signalling the callback thread with SIGUSR2, whose
+ * handler writes its own stack to stderr, since one thread can't unwind
+ * another's.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "notlib.h"
+#include "_notlib_internal.h"
+
+#if !NL_SINGLE_THREAD
+
+#define BACKTRACE_DEPTH 64
+#define MIN_CHECK_MS 10
+
+static unsigned int callback_ms = 0;
+static unsigned int queue_ms = 0;
+static int want_backtrace = 0;
+static void (*hook)(const NLStall *) = NULL;
+
+static pthread_t callback_thread;
+
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *current = NULL;  /* callback running, or NULL */
+static uint32_t current_id = 0;
+static int64_t current_start = 0;
+static uint64_t calls = 0;          /* callbacks entered so far */
+static uint64_t reported_call = 0;  /* last one reported */
+static int queue_reported = 0;
+
+extern void nl_set_watchdog(unsigned int cb_ms, unsigned int q_ms, int bt,
+                            void (*h)(const NLStall *)) {
+    callback_ms = cb_ms;
+    queue_ms = q_ms;
+    want_backtrace = bt;
+    hook = h;
+}
+
+static int watchdog_enabled(void) {
+    return callback_ms != 0 || queue_ms != 0;
+}
+
+extern void watchdog_enter(const char *callback, uint32_t id) {
+    if (callback_ms == 0)
+        return;
+    pthread_mutex_lock(&watch_lock);
+    current = callback;
+    current_id = id;
+    current_start = g_get_monotonic_time();
+    calls++;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+extern void watchdog_leave(void) {
+    if (callback_ms == 0)
+        return;
+    pthread_mutex_lock(&watch_lock);
+    current = NULL;
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void on_backtrace_signal(int sig) {
+    void *frames[BACKTRACE_DEPTH];
+    int n = backtrace(frames, BACKTRACE_DEPTH);
+    backtrace_symbols_fd(frames, n, STDERR_FILENO);
+}
+
+static void report(const NLStall *s, int running) {
+    if (running) {
+        g_printerr("Stalled: %s callback for note %u has run for %ums; "
+                   "%zu events queued, oldest waiting %ums\n",
+                   s->callback, s->id, s->running_ms, s->queue_depth,
+                   s->queue_age_ms);
+    } else {
+        g_printerr("Stalled: %zu events queued, oldest waiting %ums\n",
+                   s->queue_depth, s->queue_age_ms);
+    }
+
+    if (want_backtrace && running)
+        pthread_kill(callback_thread, SIGUSR2);
+    if (hook != NULL)
+        hook(s);
+}
+
+static gboolean check(gpointer data) {
+    int64_t now = g_get_monotonic_time();
+    int64_t oldest;
+    NLStall s;
+    int stalled = 0;
+
+    s.queue_depth = queue_stats(&oldest);
+    s.queue_age_ms = s.queue_depth > 0 ? (now - oldest) / 1000 : 0;
+
+    pthread_mutex_lock(&watch_lock);
+    s.callback = current;
+    s.id = current != NULL ? current_id : 0;
+    s.running_ms = current != NULL ? (now - current_start) / 1000 : 0;
+    if (callback_ms != 0 && current != NULL && s.running_ms >= callback_ms
+            && reported_call != calls) {
+        reported_call = calls;
+        stalled = 1;
+    }
+    pthread_mutex_unlock(&watch_lock);
+
+    if (queue_ms != 0 && s.queue_age_ms >= queue_ms) {
+        if (!queue_reported)
+            stalled = 1;
+        queue_reported = 1;
+    } else {
+        queue_reported = 0;
+    }
+
+    if (stalled)
+        report(&s, s.callback != NULL);
+    return G_SOURCE_CONTINUE;
+}
+
+// Called on the callback thread, before it starts listening.
+extern void watchdog_start(void) {
+    unsigned int every;
+
+    if (!watchdog_enabled())
+        return;
+
+    callback_thread = pthread_self();
+    if (want_backtrace) {
+        struct sigaction sa;
+        void *frame;
+
+        // backtrace may allocate the first time it's called, which isn't
+        // safe from within a signal handler.
+        backtrace(&frame, 1);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = on_backtrace_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, NULL);
+    }
+
+    every = callback_ms;
+    if (every == 0 || (queue_ms != 0 && queue_ms < every))
+        every = queue_ms;
+    every /= 4;
+    if (every < MIN_CHECK_MS)
+        every = MIN_CHECK_MS;
+    add_source(g_timeout_source_new(every), check);
+}
+
+#endif